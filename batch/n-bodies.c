@@ -0,0 +1,446 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+
+#define PATH_LENGTH 4096
+
+typedef struct Vector3 {
+    double x;
+    double y;
+    double z;
+} Vector3;
+
+// returns the number of coordinates read, like fscanf
+int read_vector(FILE *stream, Vector3 *result)
+{
+    return fscanf(
+        stream, "%lf %lf %lf",
+        &(result->x), &(result->y), &(result->z)
+    );
+}
+
+void write_vector(FILE *stream, Vector3 v)
+{
+    fprintf(stream, "(%lf, %lf, %lf)", v.x, v.y, v.z);
+}
+
+Vector3 plus(Vector3 v1, Vector3 v2)
+{
+    Vector3 sum = { v1.x + v2.x, v1.y + v2.y, v1.z + v2.z };
+    return sum;
+}
+
+Vector3 minus(Vector3 v1, Vector3 v2)
+{
+    Vector3 delta_r = { v1.x - v2.x, v1.y - v2.y, v1.z - v2.z };
+    return delta_r;
+}
+
+Vector3 multiply(double a, Vector3 v)
+{
+    Vector3 product = { a * v.x, a * v.y, a * v.z };
+    return product;
+}
+
+double absolute(Vector3 v)
+{
+    return sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
+}
+
+Vector3 gravity_density(
+    double gravitation_const, double body_radius,
+    Vector3 delta_r
+)
+{
+    double distance = absolute(delta_r);
+    double denominator = distance > body_radius ? pow(distance, 2.0) : -pow(distance, 3.0);
+    double abs_density = gravitation_const / denominator;
+    Vector3 density = {
+        abs_density * delta_r.x / distance,
+        abs_density * delta_r.y / distance,
+        abs_density * delta_r.z / distance
+    };
+    return density;
+}
+
+typedef struct Body {
+    Vector3 position;
+    Vector3 velocity;
+    double mass;
+} Body;
+
+// returns 1 if all seven numbers of the body are read
+int read_body(FILE *stream, Body *result)
+{
+    return fscanf(stream, "%lf", &result->mass) == 1
+        && read_vector(stream, &result->position) == 3
+        && read_vector(stream, &result->velocity) == 3;
+}
+
+void write_body(FILE *stream, Body body)
+{
+    fprintf(stream, "body {\n\t'mass': %lf\n\t'position': ", body.mass);
+    write_vector(stream, body.position);
+    fprintf(stream, "\n\t'velocity': ");
+    write_vector(stream, body.velocity);
+    fprintf(stream, "\n}");
+}
+
+// induced by body_2 on body_1
+Vector3 induced_acceleration(
+    double gravitation_const, double body_radius,
+    Body body_1, Body body_2
+)
+{
+    Vector3 delta_r = minus(body_2.position, body_1.position);
+    Vector3 density = gravity_density(gravitation_const, body_radius, delta_r);
+    return multiply(body_2.mass, density);
+}
+
+// one independent task from the manifest
+typedef struct System {
+    char task_file_name[PATH_LENGTH];
+    char solution_file_name[PATH_LENGTH];
+    double gravitation_const;
+    double body_radius;
+    double model_delta_t;
+    int bodies_count;
+    int simulation_steps;
+    Body *bodies;
+} System;
+
+int read_manifest(char *manifest_file_name, System **systems)
+{
+    FILE *manifest_file = fopen(manifest_file_name, "r");
+    if (!manifest_file) {
+        fprintf(stderr, "Error: Could not open manifest %s\n", manifest_file_name);
+        exit(EXIT_FAILURE);
+    }
+
+    int capacity = 16,
+        systems_count = 0;
+    *systems = (System *) malloc(capacity * sizeof(System));
+
+    char task_file_name[PATH_LENGTH], solution_file_name[PATH_LENGTH];
+    while (fscanf(manifest_file, "%4095s %4095s", task_file_name, solution_file_name) == 2) {
+        if (systems_count == capacity) {
+            capacity *= 2;
+            *systems = (System *) realloc(*systems, capacity * sizeof(System));
+        }
+        System *system = *systems + systems_count++;
+        strcpy(system->task_file_name, task_file_name);
+        strcpy(system->solution_file_name, solution_file_name);
+        system->bodies = NULL;
+    }
+
+    fclose(manifest_file);
+    return systems_count;
+}
+
+/*
+ * Both are called from worker threads, so they report the failing file and
+ * return 1 instead of exiting. The caller exits after the loop.
+ */
+int read_system(System *system)
+{
+    system->bodies_count = 0;
+    FILE *task_file = fopen(system->task_file_name, "r");
+    if (!task_file) {
+        fprintf(stderr, "Error: Could not open task %s\n", system->task_file_name);
+        return 1;
+    }
+
+    int bodies_count = 0;
+    if (fscanf(
+        task_file, "%lf %lf %lf %d %d",
+        &system->gravitation_const, &system->body_radius, &system->model_delta_t,
+        &bodies_count, &system->simulation_steps
+    ) != 5 || bodies_count < 0 || system->simulation_steps < 0) {
+        fprintf(stderr, "Error: Malformed header in task %s\n", system->task_file_name);
+        fclose(task_file);
+        return 1;
+    }
+
+    system->bodies = (Body *) malloc(bodies_count * sizeof(Body) + 1);
+    if (!system->bodies) {
+        fprintf(stderr, "Error: Could not allocate %d bodies for task %s\n", bodies_count, system->task_file_name);
+        fclose(task_file);
+        return 1;
+    }
+    for (int i = 0; i < bodies_count; ++i)
+        if (!read_body(task_file, system->bodies + i)) {
+            fprintf(stderr, "Error: Malformed body %d in task %s\n", i, system->task_file_name);
+            fclose(task_file);
+            return 1;
+        }
+    system->bodies_count = bodies_count;
+
+    fclose(task_file);
+    return 0;
+}
+
+int write_system(System *system)
+{
+    FILE *solution_file = fopen(system->solution_file_name, "w");
+    if (!solution_file) {
+        fprintf(stderr, "Error: Could not open solution %s\n", system->solution_file_name);
+        return 1;
+    }
+    for (int i = 0; i < system->bodies_count; ++i) {
+        write_body(solution_file, system->bodies[i]);
+        fprintf(solution_file, "\n");
+    }
+    int failed = ferror(solution_file);
+    if (fclose(solution_file) != 0 || failed) {
+        fprintf(stderr, "Error: Could not write solution %s\n", system->solution_file_name);
+        return 1;
+    }
+    return 0;
+}
+
+// whole system on one thread, accelerations go straight into velocities
+void simulate_system(System *system)
+{
+    int bodies_count = system->bodies_count;
+    Body *bodies = system->bodies;
+
+    for (int step = 0; step < system->simulation_steps; ++step) {
+        for (int i = 0; i < bodies_count; ++i)
+            for (int j = 0; j < bodies_count; ++j)
+                if (i != j)
+                    bodies[i].velocity = plus(
+                        bodies[i].velocity,
+                        induced_acceleration(
+                            system->gravitation_const, system->body_radius,
+                            bodies[i], bodies[j]
+                        )
+                    );
+
+        for (int i = 0; i < bodies_count; ++i)
+            bodies[i].position = plus(
+                bodies[i].position,
+                multiply(system->model_delta_t, bodies[i].velocity)
+            );
+    }
+}
+
+// systems of equal size and length, one SIMD lane per system
+typedef struct Pack {
+    int lanes;
+    int bodies_count;
+    int simulation_steps;
+    System **systems;
+    // lane-major arrays: value of body i in lane l is at [i * lanes + l]
+    double *gravitation_const, *body_radius, *model_delta_t;
+    double *x, *y, *z, *vx, *vy, *vz, *mass;
+} Pack;
+
+void pack_systems(Pack *pack)
+{
+    int lanes = pack->lanes,
+        size = pack->bodies_count * lanes;
+
+    pack->gravitation_const = (double *) malloc(3 * lanes * sizeof(double));
+    pack->body_radius = pack->gravitation_const + lanes;
+    pack->model_delta_t = pack->body_radius + lanes;
+
+    pack->x = (double *) malloc(7 * size * sizeof(double));
+    pack->y = pack->x + size;
+    pack->z = pack->y + size;
+    pack->vx = pack->z + size;
+    pack->vy = pack->vx + size;
+    pack->vz = pack->vy + size;
+    pack->mass = pack->vz + size;
+
+    for (int l = 0; l < lanes; ++l) {
+        System *system = pack->systems[l];
+        pack->gravitation_const[l] = system->gravitation_const;
+        pack->body_radius[l] = system->body_radius;
+        pack->model_delta_t[l] = system->model_delta_t;
+
+        for (int i = 0; i < pack->bodies_count; ++i) {
+            Body body = system->bodies[i];
+            pack->x[i * lanes + l] = body.position.x;
+            pack->y[i * lanes + l] = body.position.y;
+            pack->z[i * lanes + l] = body.position.z;
+            pack->vx[i * lanes + l] = body.velocity.x;
+            pack->vy[i * lanes + l] = body.velocity.y;
+            pack->vz[i * lanes + l] = body.velocity.z;
+            pack->mass[i * lanes + l] = body.mass;
+        }
+    }
+}
+
+void unpack_systems(Pack *pack)
+{
+    int lanes = pack->lanes;
+
+    for (int l = 0; l < lanes; ++l) {
+        System *system = pack->systems[l];
+        for (int i = 0; i < pack->bodies_count; ++i) {
+            Body body = {
+                { pack->x[i * lanes + l], pack->y[i * lanes + l], pack->z[i * lanes + l] },
+                { pack->vx[i * lanes + l], pack->vy[i * lanes + l], pack->vz[i * lanes + l] },
+                pack->mass[i * lanes + l]
+            };
+            system->bodies[i] = body;
+        }
+    }
+
+    free(pack->gravitation_const);
+    free(pack->x);
+}
+
+void simulate_pack(Pack *pack)
+{
+    int lanes = pack->lanes,
+        bodies_count = pack->bodies_count;
+    double *g = pack->gravitation_const,
+        *radius = pack->body_radius,
+        *dt = pack->model_delta_t,
+        *x = pack->x, *y = pack->y, *z = pack->z,
+        *vx = pack->vx, *vy = pack->vy, *vz = pack->vz,
+        *mass = pack->mass;
+
+    for (int step = 0; step < pack->simulation_steps; ++step) {
+        for (int i = 0; i < bodies_count; ++i)
+            for (int j = 0; j < bodies_count; ++j) {
+                if (i == j)
+                    continue;
+                #pragma omp simd
+                for (int l = 0; l < lanes; ++l) {
+                    double dx = x[j * lanes + l] - x[i * lanes + l],
+                        dy = y[j * lanes + l] - y[i * lanes + l],
+                        dz = z[j * lanes + l] - z[i * lanes + l];
+                    double distance = sqrt(dx * dx + dy * dy + dz * dz);
+                    double denominator = distance > radius[l] ?
+                        distance * distance : -distance * distance * distance;
+                    double abs_density = g[l] / denominator;
+                    double m = mass[j * lanes + l];
+                    vx[i * lanes + l] += m * (abs_density * dx / distance);
+                    vy[i * lanes + l] += m * (abs_density * dy / distance);
+                    vz[i * lanes + l] += m * (abs_density * dz / distance);
+                }
+            }
+
+        for (int i = 0; i < bodies_count; ++i) {
+            #pragma omp simd
+            for (int l = 0; l < lanes; ++l) {
+                x[i * lanes + l] += dt[l] * vx[i * lanes + l];
+                y[i * lanes + l] += dt[l] * vy[i * lanes + l];
+                z[i * lanes + l] += dt[l] * vz[i * lanes + l];
+            }
+        }
+    }
+}
+
+int compare_systems(const void *a, const void *b)
+{
+    const System *s1 = *(System * const *) a,
+        *s2 = *(System * const *) b;
+    if (s1->bodies_count != s2->bodies_count)
+        return s1->bodies_count - s2->bodies_count;
+    return s1->simulation_steps - s2->simulation_steps;
+}
+
+// groups systems with equal bodies_count and simulation_steps into packs of at most max_lanes
+int make_packs(int systems_count, System *systems, int max_lanes, System **order, Pack **packs)
+{
+    for (int i = 0; i < systems_count; ++i)
+        order[i] = systems + i;
+    qsort(order, systems_count, sizeof(System *), compare_systems);
+
+    *packs = (Pack *) malloc(systems_count * sizeof(Pack));
+    int packs_count = 0;
+    for (int begin = 0; begin < systems_count; ) {
+        int end = begin + 1;
+        while (
+            end < systems_count && end - begin < max_lanes
+            && compare_systems(order + begin, order + end) == 0
+        )
+            ++end;
+
+        Pack *pack = *packs + packs_count++;
+        pack->lanes = end - begin;
+        pack->bodies_count = order[begin]->bodies_count;
+        pack->simulation_steps = order[begin]->simulation_steps;
+        pack->systems = order + begin;
+        begin = end;
+    }
+
+    return packs_count;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s path/to/manifest.txt [lanes]\n", argv[0]);
+        return 1;
+    }
+    int max_lanes = argc > 2 ? atoi(argv[2]) : 1;
+    if (max_lanes < 1)
+        max_lanes = 1;
+
+    System *systems;
+    int systems_count = read_manifest(argv[1], &systems);
+
+    int failures = 0;
+    #pragma omp parallel for schedule(dynamic) reduction(+: failures)
+    for (int s = 0; s < systems_count; ++s)
+        failures += read_system(systems + s);
+    if (failures > 0) {
+        fprintf(stderr, "Error: %d of %d tasks could not be read\n", failures, systems_count);
+        for (int s = 0; s < systems_count; ++s)
+            free(systems[s].bodies);
+        free(systems);
+        return EXIT_FAILURE;
+    }
+
+    System **order = (System **) malloc(systems_count * sizeof(System *));
+    Pack *packs;
+    int packs_count = make_packs(systems_count, systems, max_lanes, order, &packs);
+
+    double systems_steps = 0.0;
+    for (int s = 0; s < systems_count; ++s)
+        systems_steps += systems[s].simulation_steps;
+
+    double begin, end;
+    begin = omp_get_wtime();
+
+    // packs are sorted by size, so the biggest ones are scheduled first
+    #pragma omp parallel for schedule(dynamic)
+    for (int p = packs_count - 1; p >= 0; --p) {
+        Pack *pack = packs + p;
+        if (pack->lanes == 1) {
+            simulate_system(pack->systems[0]);
+        } else {
+            pack_systems(pack);
+            simulate_pack(pack);
+            unpack_systems(pack);
+        }
+    }
+
+    end = omp_get_wtime();
+    printf("Time taken: %lf sec\n", end - begin);
+    printf("Systems: %d, packs: %d\n", systems_count, packs_count);
+    printf("Systems-steps per second: %lf\n", systems_steps / (end - begin));
+
+    // a failed solution does not stop the others from being written
+    #pragma omp parallel for schedule(dynamic) reduction(+: failures)
+    for (int s = 0; s < systems_count; ++s) {
+        failures += write_system(systems + s);
+        free(systems[s].bodies);
+    }
+
+    free(packs);
+    free(order);
+    free(systems);
+
+    if (failures > 0) {
+        fprintf(stderr, "Error: %d of %d solutions could not be written\n", failures, systems_count);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
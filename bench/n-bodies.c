@@ -0,0 +1,613 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <omp.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAS_TSC 1
+#else
+#define HAS_TSC 0
+#endif
+
+#define NAME_LENGTH 64
+#define MIN_SAMPLE_NS 1e6 // a sample repeats a kernel until it takes at least 1 ms
+#define WARM_UP_SAMPLES 3
+
+/*
+ * Kernels below are copies of the ones in sequential/n-bodies.c and
+ * open-mp/n-bodies.c, keep them in sync.
+ */
+
+typedef struct Vector3 {
+    double x;
+    double y;
+    double z;
+} Vector3;
+
+Vector3 plus(Vector3 v1, Vector3 v2)
+{
+    Vector3 sum = { v1.x + v2.x, v1.y + v2.y, v1.z + v2.z };
+    return sum;
+}
+
+Vector3 minus(Vector3 v1, Vector3 v2)
+{
+    Vector3 delta_r = { v1.x - v2.x, v1.y - v2.y, v1.z - v2.z };
+    return delta_r;
+}
+
+Vector3 multiply(double a, Vector3 v)
+{
+    Vector3 product = { a * v.x, a * v.y, a * v.z };
+    return product;
+}
+
+double absolute(Vector3 v)
+{
+    return sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
+}
+
+Vector3 gravity_density(
+    double gravitation_const, double body_radius,
+    Vector3 delta_r
+)
+{
+    double distance = absolute(delta_r);
+    double denominator = distance > body_radius ? pow(distance, 2.0) : -pow(distance, 3.0);
+    double abs_density = gravitation_const / denominator;
+    Vector3 density = {
+        abs_density * delta_r.x / distance,
+        abs_density * delta_r.y / distance,
+        abs_density * delta_r.z / distance
+    };
+    return density;
+}
+
+typedef struct Body {
+    Vector3 position;
+    Vector3 velocity;
+    double mass;
+} Body;
+
+// induced by body_2 on body_1
+Vector3 induced_acceleration(
+    double gravitation_const, double body_radius,
+    Body body_1, Body body_2
+)
+{
+    Vector3 delta_r = minus(body_2.position, body_1.position);
+    Vector3 density = gravity_density(gravitation_const, body_radius, delta_r);
+    return multiply(body_2.mass, density);
+}
+
+/*
+ * Potential energy of two unit masses, consistent with gravity_density:
+ * -G / d outside of body_radius and the integral of the repulsion inside.
+ */
+double pair_potential(double gravitation_const, double body_radius, double distance)
+{
+    if (distance > body_radius)
+        return -gravitation_const / distance;
+    return gravitation_const / (2.0 * distance * distance)
+        - gravitation_const / body_radius
+        - gravitation_const / (2.0 * body_radius * body_radius);
+}
+
+// induced_acceleration that also gives the potential energy of the pair, the distance is computed once
+Vector3 induced_acceleration_potential(
+    double gravitation_const, double body_radius,
+    Body body_1, Body body_2, double *energy
+)
+{
+    Vector3 delta_r = minus(body_2.position, body_1.position);
+    double distance = absolute(delta_r);
+    double denominator = distance > body_radius ? pow(distance, 2.0) : -pow(distance, 3.0);
+    double abs_density = gravitation_const / denominator;
+    Vector3 density = {
+        abs_density * delta_r.x / distance,
+        abs_density * delta_r.y / distance,
+        abs_density * delta_r.z / distance
+    };
+    *energy = body_1.mass * body_2.mass * pair_potential(gravitation_const, body_radius, distance);
+    return multiply(body_2.mass, density);
+}
+
+#define TILE_SIZE 64 // bodies of a column tile stay in L1 while the rows are walked
+
+void calculate_accelerations_sequential(
+    double gravitation_const, double body_radius,
+    int bodies_count, Body *bodies, Vector3 *accelerations
+)
+{
+    for (int tile = 0; tile < bodies_count; tile += TILE_SIZE) {
+        int tile_end = tile + TILE_SIZE < bodies_count ? tile + TILE_SIZE : bodies_count;
+        for (int i = 0; i < bodies_count; ++i)
+            for (int j = tile; j < tile_end; ++j)
+                if (i == j)
+                    accelerations[i * bodies_count + j].x =
+                        accelerations[i * bodies_count + j].y =
+                        accelerations[i * bodies_count + j].z = 0.0;
+                else
+                    accelerations[i * bodies_count + j] = induced_acceleration(
+                        gravitation_const, body_radius, bodies[i], bodies[j]
+                    );
+    }
+}
+
+/*
+ * Rows from row_begin to row_end of the acceleration matrix, columns go in tiles
+ * of TILE_SIZE bodies. Returns the sum of the pair energies if with_potential.
+ */
+double calculate_rows(
+    double gravitation_const, double body_radius,
+    int bodies_count, Body *bodies, Vector3 *accelerations,
+    int row_begin, int row_end, int with_potential
+)
+{
+    double pair_energy = 0.0;
+    for (int tile = 0; tile < bodies_count; tile += TILE_SIZE) {
+        int tile_end = tile + TILE_SIZE < bodies_count ? tile + TILE_SIZE : bodies_count;
+        for (int i = row_begin; i < row_end; ++i)
+            for (int j = tile; j < tile_end; ++j)
+                if (i == j)
+                    accelerations[i * bodies_count + j].x =
+                        accelerations[i * bodies_count + j].y =
+                        accelerations[i * bodies_count + j].z = 0.0;
+                else if (!with_potential)
+                    accelerations[i * bodies_count + j] = induced_acceleration(
+                        gravitation_const, body_radius, bodies[i], bodies[j]
+                    );
+                else {
+                    double energy;
+                    accelerations[i * bodies_count + j] = induced_acceleration_potential(
+                        gravitation_const, body_radius, bodies[i], bodies[j], &energy
+                    );
+                    pair_energy += energy;
+                }
+    }
+    return pair_energy;
+}
+
+/*
+ * Every thread takes the same rows of the matrix as in first_touch.
+ * Potential energy of the system is accumulated in the same loop if potential is not NULL.
+ */
+void calculate_accelerations_open_mp(
+    double gravitation_const, double body_radius,
+    int bodies_count, Body *bodies, Vector3 *accelerations, double *potential
+)
+{
+    double pair_energy = 0.0;
+    #pragma omp parallel shared(bodies, accelerations) reduction(+: pair_energy)
+    {
+        int threads = omp_get_num_threads(),
+            thread = omp_get_thread_num();
+        pair_energy += calculate_rows(
+            gravitation_const, body_radius, bodies_count, bodies, accelerations,
+            (long long) bodies_count * thread / threads,
+            (long long) bodies_count * (thread + 1) / threads,
+            potential != NULL
+        );
+    }
+    // every pair is visited twice
+    if (potential != NULL)
+        *potential = pair_energy / 2.0;
+}
+
+void accelerate_sequential(
+    int bodies_count, Body *bodies, Vector3 *accelerations
+)
+{
+    for (int i = 0; i < bodies_count; ++i)
+        for (int j = 0; j < bodies_count; ++j)
+            bodies[i].velocity = plus(
+                bodies[i].velocity, accelerations[i * bodies_count + j]
+            );
+}
+
+void accelerate_open_mp(
+    int bodies_count, Body *bodies, Vector3 *accelerations
+)
+{
+    #pragma omp parallel shared(bodies, accelerations)
+    {
+        #pragma omp for schedule(static)
+        for (int i = 0; i < bodies_count; ++i) {
+            for (int j = 0; j < bodies_count; ++j) {
+                bodies[i].velocity = plus(
+                    bodies[i].velocity, accelerations[i * bodies_count + j]
+                );
+            }
+        }
+    }
+}
+
+void move_sequential(
+    double model_delta_t, int bodies_count, Body *bodies
+)
+{
+    for (int i = 0; i < bodies_count; ++i)
+        bodies[i].position = plus(
+            bodies[i].position,
+            multiply(model_delta_t, bodies[i].velocity)
+        );
+}
+
+void move_open_mp(
+    double model_delta_t, int bodies_count, Body *bodies
+)
+{
+    #pragma omp parallel shared(bodies)
+    {
+        #pragma omp for schedule(static)
+        for (int i = 0; i < bodies_count; ++i)
+            bodies[i].position = plus(
+                bodies[i].position,
+                multiply(model_delta_t, bodies[i].velocity)
+            );
+    }
+}
+
+// data of one benchmark size, every kernel uses its own part of it
+typedef struct Workload {
+    int n;
+    Body *bodies;
+    Vector3 *deltas;
+    Vector3 *results;
+    Vector3 *accelerations;
+    double potential;
+} Workload;
+
+#define GRAVITATION_CONST 1.0
+#define BODY_RADIUS 0.01
+#define MODEL_DELTA_T 1e-6
+
+void run_gravity_density(Workload *w)
+{
+    for (int i = 0; i < w->n; ++i)
+        w->results[i] = gravity_density(GRAVITATION_CONST, BODY_RADIUS, w->deltas[i]);
+}
+
+void run_induced_acceleration(Workload *w)
+{
+    for (int i = 0; i < w->n; ++i)
+        w->results[i] = induced_acceleration(
+            GRAVITATION_CONST, BODY_RADIUS, w->bodies[i], w->bodies[(i + 1) % w->n]
+        );
+}
+
+void run_induced_acceleration_potential(Workload *w)
+{
+    double sum = 0.0;
+    for (int i = 0; i < w->n; ++i) {
+        double energy;
+        w->results[i] = induced_acceleration_potential(
+            GRAVITATION_CONST, BODY_RADIUS, w->bodies[i], w->bodies[(i + 1) % w->n], &energy
+        );
+        sum += energy;
+    }
+    w->potential = sum;
+}
+
+void run_calculate_accelerations_sequential(Workload *w)
+{
+    calculate_accelerations_sequential(GRAVITATION_CONST, BODY_RADIUS, w->n, w->bodies, w->accelerations);
+}
+
+void run_calculate_accelerations_open_mp(Workload *w)
+{
+    calculate_accelerations_open_mp(GRAVITATION_CONST, BODY_RADIUS, w->n, w->bodies, w->accelerations, NULL);
+}
+
+void run_calculate_accelerations_open_mp_potential(Workload *w)
+{
+    calculate_accelerations_open_mp(GRAVITATION_CONST, BODY_RADIUS, w->n, w->bodies, w->accelerations, &w->potential);
+}
+
+void run_accelerate_sequential(Workload *w)
+{
+    accelerate_sequential(w->n, w->bodies, w->accelerations);
+}
+
+void run_accelerate_open_mp(Workload *w)
+{
+    accelerate_open_mp(w->n, w->bodies, w->accelerations);
+}
+
+void run_move_sequential(Workload *w)
+{
+    move_sequential(MODEL_DELTA_T, w->n, w->bodies);
+}
+
+void run_move_open_mp(Workload *w)
+{
+    move_open_mp(MODEL_DELTA_T, w->n, w->bodies);
+}
+
+size_t linear_bodies_set(long long n) { return n * (sizeof(Body) + sizeof(Vector3)); }
+size_t linear_deltas_set(long long n) { return n * 2 * sizeof(Vector3); }
+size_t quadratic_set(long long n) { return n * sizeof(Body) + n * n * sizeof(Vector3); }
+size_t bodies_set(long long n) { return n * sizeof(Body); }
+
+long long linear(long long n) { return n; }
+long long quadratic(long long n) { return n * n; }
+
+/*
+ * flops are counted per interaction from the source, sqrt and division
+ * count as one operation, pow(d, 2.0) as one multiplication:
+ * gravity_density 14, induced_acceleration 3 + 14 + 3, accelerate 3 additions,
+ * move 3 multiplications and 3 additions. induced_acceleration_potential adds
+ * the division and negation of pair_potential and two multiplications by the
+ * masses, the fused calculate_accelerations also adds the energy to the sum.
+ */
+typedef struct Kernel {
+    const char *name;
+    double flops;
+    size_t (*working_set)(long long n); // bytes touched by one run
+    long long (*interactions)(long long n);
+    void (*run)(Workload *w);
+} Kernel;
+
+Kernel kernels[] = {
+    { "gravity_density", 14.0, linear_deltas_set, linear, run_gravity_density },
+    { "induced_acceleration", 20.0, linear_bodies_set, linear, run_induced_acceleration },
+    { "induced_acceleration_potential", 24.0, linear_bodies_set, linear, run_induced_acceleration_potential },
+    { "calculate_accelerations/sequential", 20.0, quadratic_set, quadratic, run_calculate_accelerations_sequential },
+    { "calculate_accelerations/open-mp", 20.0, quadratic_set, quadratic, run_calculate_accelerations_open_mp },
+    { "calculate_accelerations/open-mp+potential", 25.0, quadratic_set, quadratic, run_calculate_accelerations_open_mp_potential },
+    { "accelerate/sequential", 3.0, quadratic_set, quadratic, run_accelerate_sequential },
+    { "accelerate/open-mp", 3.0, quadratic_set, quadratic, run_accelerate_open_mp },
+    { "move/sequential", 6.0, bodies_set, linear, run_move_sequential },
+    { "move/open-mp", 6.0, bodies_set, linear, run_move_open_mp }
+};
+
+typedef struct Level {
+    const char *name;
+    size_t target; // working set in bytes
+} Level;
+
+size_t cache_size(int name, size_t fallback)
+{
+    long size = sysconf(name);
+    return size > 0 ? (size_t) size : fallback;
+}
+
+// half of every cache level, so the working set stays resident, and four times the last level for DRAM
+void get_levels(Level *levels)
+{
+    size_t l1 = cache_size(_SC_LEVEL1_DCACHE_SIZE, 32ul << 10),
+        l2 = cache_size(_SC_LEVEL2_CACHE_SIZE, 1ul << 20),
+        l3 = cache_size(_SC_LEVEL3_CACHE_SIZE, 32ul << 20);
+    Level result[] = {
+        { "L1", l1 / 2 },
+        { "L2", l2 / 2 },
+        { "L3", l3 / 2 },
+        { "DRAM", 4 * l3 > (64ul << 20) ? 4 * l3 : (64ul << 20) }
+    };
+    memcpy(levels, result, sizeof(result));
+}
+
+// the largest n whose working set fits into the target
+long long size_for(Kernel *kernel, size_t target)
+{
+    long long low = 2, high = 4;
+    while (kernel->working_set(high) <= target)
+        high *= 2;
+    while (high - low > 1) {
+        long long middle = (low + high) / 2;
+        if (kernel->working_set(middle) <= target)
+            low = middle;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+void init_workload(Workload *w, int n, int accelerations_count)
+{
+    w->n = n;
+    w->potential = 0.0;
+    w->bodies = malloc(n * sizeof(Body));
+    w->deltas = malloc(n * sizeof(Vector3));
+    w->results = calloc(n, sizeof(Vector3));
+    w->accelerations = malloc((size_t) accelerations_count * sizeof(Vector3));
+
+    srand(1);
+    for (int i = 0; i < n; ++i) {
+        Vector3 position = { rand() / (double) RAND_MAX, rand() / (double) RAND_MAX, rand() / (double) RAND_MAX },
+            center = { 0.5, 0.5, 0.5 },
+            zero = { 0.0, 0.0, 0.0 };
+        Body body = { position, zero, 1.0 };
+        w->bodies[i] = body;
+        w->deltas[i] = minus(position, center);
+    }
+    for (int k = 0; k < accelerations_count; ++k)
+        w->accelerations[k].x = w->accelerations[k].y = w->accelerations[k].z = 1e-9;
+}
+
+void free_workload(Workload *w)
+{
+    free(w->bodies);
+    free(w->deltas);
+    free(w->results);
+    free(w->accelerations);
+}
+
+double now_ns()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+unsigned long long read_tsc()
+{
+#if HAS_TSC
+    return __rdtsc();
+#else
+    return 0ull;
+#endif
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double d1 = *(const double *) a, d2 = *(const double *) b;
+    return (d1 > d2) - (d1 < d2);
+}
+
+typedef struct Statistics {
+    double median;
+    double min;
+    double mean;
+    double deviation; // relative standard deviation, %
+    double cycles; // median, per interaction
+} Statistics;
+
+double median_of(int count, double *values)
+{
+    qsort(values, count, sizeof(double), compare_doubles);
+    return count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2.0;
+}
+
+/*
+ * Every sample runs the kernel repeats times, repeats is chosen during
+ * warm-up so that a sample lasts at least MIN_SAMPLE_NS.
+ */
+Statistics measure(Kernel *kernel, Workload *w, int repetitions)
+{
+    double interactions = (double) kernel->interactions(w->n);
+    int repeats = 1;
+    for (int s = 0; s < WARM_UP_SAMPLES; ++s) {
+        double begin = now_ns();
+        for (int r = 0; r < repeats; ++r)
+            kernel->run(w);
+        double elapsed = now_ns() - begin;
+        while (elapsed < MIN_SAMPLE_NS && repeats < (1 << 24)) {
+            repeats *= 2;
+            elapsed *= 2;
+        }
+    }
+
+    double *ns = malloc(repetitions * sizeof(double)),
+        *cycles = malloc(repetitions * sizeof(double));
+    for (int s = 0; s < repetitions; ++s) {
+        unsigned long long tsc_begin = read_tsc();
+        double begin = now_ns();
+        for (int r = 0; r < repeats; ++r)
+            kernel->run(w);
+        double elapsed = now_ns() - begin;
+        cycles[s] = (read_tsc() - tsc_begin) / (interactions * repeats);
+        ns[s] = elapsed / (interactions * repeats);
+    }
+
+    Statistics result;
+    double sum = 0.0, square_sum = 0.0;
+    for (int s = 0; s < repetitions; ++s) {
+        sum += ns[s];
+        square_sum += ns[s] * ns[s];
+    }
+    result.mean = sum / repetitions;
+    double variance = square_sum / repetitions - result.mean * result.mean;
+    result.deviation = variance > 0.0 ? 100.0 * sqrt(variance) / result.mean : 0.0;
+    result.median = median_of(repetitions, ns);
+    result.min = ns[0];
+    result.cycles = median_of(repetitions, cycles);
+
+    free(ns);
+    free(cycles);
+    return result;
+}
+
+typedef struct BaselineEntry {
+    char kernel[NAME_LENGTH];
+    char level[NAME_LENGTH];
+    double ns;
+} BaselineEntry;
+
+// lines of a previous output, comments start with '#'
+int read_baseline(char *file_name, BaselineEntry **entries)
+{
+    FILE *baseline_file = fopen(file_name, "r");
+    if (!baseline_file) {
+        fprintf(stderr, "Error: Could not open %s\n", file_name);
+        exit(1);
+    }
+
+    int count = 0, capacity = 16;
+    char line[1024];
+    *entries = malloc(capacity * sizeof(BaselineEntry));
+    while (fgets(line, sizeof(line), baseline_file)) {
+        if (line[0] == '#')
+            continue;
+        BaselineEntry entry;
+        int n;
+        if (sscanf(line, "%63s %63s %d %lf", entry.kernel, entry.level, &n, &entry.ns) != 4)
+            continue;
+        if (count == capacity) {
+            capacity *= 2;
+            *entries = realloc(*entries, capacity * sizeof(BaselineEntry));
+        }
+        (*entries)[count++] = entry;
+    }
+    fclose(baseline_file);
+    return count;
+}
+
+double find_baseline(int count, BaselineEntry *entries, const char *kernel, const char *level)
+{
+    for (int k = 0; k < count; ++k)
+        if (strcmp(entries[k].kernel, kernel) == 0 && strcmp(entries[k].level, level) == 0)
+            return entries[k].ns;
+    return 0.0;
+}
+
+int main(int argc, char **argv)
+{
+    int repetitions = argc > 1 ? atoi(argv[1]) : 10;
+    if (repetitions < 1)
+        repetitions = 1;
+    BaselineEntry *baseline = NULL;
+    int baseline_count = argc > 2 ? read_baseline(argv[2], &baseline) : 0;
+
+    Level levels[4];
+    get_levels(levels);
+
+    printf("# threads %d, repetitions %d, tsc %s\n", omp_get_max_threads(), repetitions, HAS_TSC ? "yes" : "no");
+    printf("# kernel level n ns/interaction cycles/interaction GFLOP/s min-ns mean-ns deviation-%%");
+    printf(baseline_count > 0 ? " change-%%\n" : "\n");
+
+    double checksum = 0.0;
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(Kernel); ++k) {
+        Kernel *kernel = kernels + k;
+        for (int l = 0; l < 4; ++l) {
+            long long n = size_for(kernel, levels[l].target);
+            Workload w;
+            init_workload(&w, (int) n, kernel->interactions == quadratic ? (int) (n * n) : 0);
+
+            Statistics statistics = measure(kernel, &w, repetitions);
+            printf(
+                "%s %s %lld %.4lf %.2lf %.3lf %.4lf %.4lf %.1lf",
+                kernel->name, levels[l].name, n, statistics.median, statistics.cycles,
+                kernel->flops / statistics.median, statistics.min, statistics.mean, statistics.deviation
+            );
+            double previous = find_baseline(baseline_count, baseline, kernel->name, levels[l].name);
+            if (previous > 0.0)
+                printf(" %+.1lf", 100.0 * (statistics.median / previous - 1.0));
+            else if (baseline_count > 0)
+                printf(" -");
+            printf("\n");
+            fflush(stdout);
+
+            checksum += w.results[0].x + w.bodies[0].position.x + w.bodies[0].velocity.x + w.potential;
+            free_workload(&w);
+        }
+    }
+
+    // keeps the compiler from dropping the kernels
+    fprintf(stderr, "Checksum: %lf\n", checksum);
+    free(baseline);
+    return 0;
+}
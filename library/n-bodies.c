@@ -0,0 +1,449 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef WITH_OPENCL
+#include <CL/cl.h>
+#endif
+
+#include "n-bodies.h"
+
+static NBodiesVector3 plus(NBodiesVector3 v1, NBodiesVector3 v2)
+{
+    NBodiesVector3 sum = { v1.x + v2.x, v1.y + v2.y, v1.z + v2.z };
+    return sum;
+}
+
+static NBodiesVector3 minus(NBodiesVector3 v1, NBodiesVector3 v2)
+{
+    NBodiesVector3 delta_r = { v1.x - v2.x, v1.y - v2.y, v1.z - v2.z };
+    return delta_r;
+}
+
+static NBodiesVector3 multiply(double a, NBodiesVector3 v)
+{
+    NBodiesVector3 product = { a * v.x, a * v.y, a * v.z };
+    return product;
+}
+
+static double absolute(NBodiesVector3 v)
+{
+    return sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
+}
+
+static NBodiesVector3 gravity_density(
+    double gravitation_const, double body_radius,
+    NBodiesVector3 delta_r
+)
+{
+    double distance = absolute(delta_r);
+    double denominator = distance > body_radius ? pow(distance, 2.0) : -pow(distance, 3.0);
+    double abs_density = gravitation_const / denominator;
+    NBodiesVector3 density = {
+        abs_density * delta_r.x / distance,
+        abs_density * delta_r.y / distance,
+        abs_density * delta_r.z / distance
+    };
+    return density;
+}
+
+// induced by body_2 on body_1
+static NBodiesVector3 induced_acceleration(
+    double gravitation_const, double body_radius,
+    NBodiesBody body_1, NBodiesBody body_2
+)
+{
+    NBodiesVector3 delta_r = minus(body_2.position, body_1.position);
+    NBodiesVector3 density = gravity_density(gravitation_const, body_radius, delta_r);
+    return multiply(body_2.mass, density);
+}
+
+#ifdef WITH_OPENCL
+#define TUNING_FILE_NAME "n-bodies.tuning"
+
+typedef struct __attribute__ ((packed)) DeviceVector3 {
+    float x;
+    float y;
+    float z;
+} DeviceVector3;
+
+typedef struct __attribute__ ((packed)) DeviceBody {
+    DeviceVector3 position;
+    DeviceVector3 velocity;
+    float mass;
+} DeviceBody;
+
+// everything the OpenCL backend keeps between calls
+typedef struct Device {
+    cl_context context;
+    cl_command_queue commands;
+    cl_program program;
+    cl_kernel step_kernel;
+    cl_mem parameters_mem[4]; // g, body_radius, bodies_count, model_dt
+    cl_mem bodies_mem[2];
+    size_t local_size;
+    DeviceBody *staging;
+} Device;
+#endif
+
+struct NBodiesSimulation {
+    NBodiesBackend backend;
+    double gravitation_const;
+    double body_radius;
+    double model_delta_t;
+    int bodies_count;
+    NBodiesBody *bodies;
+    NBodiesVector3 *velocities; // velocities of the next step, so that bodies are only read while they are summed
+#ifdef WITH_OPENCL
+    Device device;
+#endif
+};
+
+static void cpu_step(NBodiesSimulation *simulation)
+{
+    int bodies_count = simulation->bodies_count,
+        parallel = simulation->backend == N_BODIES_BACKEND_OPEN_MP;
+    NBodiesBody *bodies = simulation->bodies;
+    NBodiesVector3 *velocities = simulation->velocities;
+
+    #pragma omp parallel for schedule(static) if(parallel)
+    for (int i = 0; i < bodies_count; ++i) {
+        NBodiesVector3 velocity = bodies[i].velocity;
+        for (int j = 0; j < bodies_count; ++j)
+            if (i != j)
+                velocity = plus(
+                    velocity,
+                    induced_acceleration(
+                        simulation->gravitation_const, simulation->body_radius,
+                        bodies[i], bodies[j]
+                    )
+                );
+        velocities[i] = velocity;
+    }
+
+    #pragma omp parallel for schedule(static) if(parallel)
+    for (int i = 0; i < bodies_count; ++i) {
+        bodies[i].velocity = velocities[i];
+        bodies[i].position = plus(
+            bodies[i].position,
+            multiply(simulation->model_delta_t, bodies[i].velocity)
+        );
+    }
+}
+
+#ifdef WITH_OPENCL
+#define MAX_DEVICES 64
+
+static const char *device_type_name(cl_device_type device_type)
+{
+    if (device_type & CL_DEVICE_TYPE_GPU)
+        return "gpu";
+    if (device_type & CL_DEVICE_TYPE_CPU)
+        return "cpu";
+    if (device_type & CL_DEVICE_TYPE_ACCELERATOR)
+        return "accelerator";
+    return "other";
+}
+
+/*
+ * Same choice as in the OpenCL program: N_BODIES_DEVICE is an index into the devices
+ * of all platforms or cpu, gpu, accelerator for the first device of that type,
+ * without it the first default device is taken.
+ */
+static cl_int get_device_id(cl_device_id *result)
+{
+    cl_uint num_platforms;
+    cl_int status = clGetPlatformIDs(0, NULL, &num_platforms);
+    if (status != CL_SUCCESS)
+        return status;
+    if (num_platforms == 0)
+        return CL_DEVICE_NOT_FOUND;
+
+    cl_platform_id platforms[num_platforms];
+    status = clGetPlatformIDs(num_platforms, platforms, NULL);
+    if (status != CL_SUCCESS)
+        return status;
+
+    const char *choice = getenv("N_BODIES_DEVICE");
+    if (!choice) {
+        status = CL_DEVICE_NOT_FOUND;
+        for (cl_uint i = 0; status != CL_SUCCESS && i < num_platforms; ++i)
+            status = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_DEFAULT, 1, result, NULL);
+        return status;
+    }
+
+    cl_device_id devices[MAX_DEVICES];
+    cl_uint count = 0;
+    for (cl_uint i = 0; i < num_platforms && count < MAX_DEVICES; ++i) {
+        cl_uint platform_count;
+        if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, MAX_DEVICES - count, devices + count, &platform_count) != CL_SUCCESS)
+            continue;
+        count += platform_count < MAX_DEVICES - count ? platform_count : MAX_DEVICES - count;
+    }
+
+    char *end;
+    long index = strtol(choice, &end, 10);
+    for (cl_uint d = 0; d < count; ++d) {
+        cl_device_type device_type;
+        clGetDeviceInfo(devices[d], CL_DEVICE_TYPE, sizeof(device_type), &device_type, NULL);
+        if (
+            (*end == '\0' && end != choice && index == (long) d)
+            || strcmp(choice, device_type_name(device_type)) == 0
+        ) {
+            *result = devices[d];
+            return CL_SUCCESS;
+        }
+    }
+    return CL_DEVICE_NOT_FOUND;
+}
+
+static char *read_kernel_source(const char *file_name)
+{
+    FILE *file = fopen(file_name, "r");
+    if (!file)
+        return NULL;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    rewind(file);
+
+    char *source = calloc(length + 1, sizeof(char));
+    if (source)
+        fread(source, sizeof(char), length, file);
+    fclose(file);
+    return source;
+}
+
+// parameters of the step kernel, tile_size and unroll are passed as -D build options
+typedef struct Tuning {
+    int local_size;
+    int tile_size;
+    int unroll;
+} Tuning;
+
+/*
+ * Same file as the OpenCL program writes after autotuning, every line is
+ * "low high local_size tile_size unroll device name". The library does not tune
+ * itself, so result is left untouched if there is no entry for the device.
+ */
+static void load_tuning(const char *device_name, int bodies_count, Tuning *result)
+{
+    FILE *tuning_file = fopen(TUNING_FILE_NAME, "r");
+    if (!tuning_file)
+        return;
+
+    int low, high;
+    Tuning tuning;
+    char name[256];
+    while (fscanf(
+        tuning_file, "%d %d %d %d %d %255[^\n]",
+        &low, &high, &tuning.local_size, &tuning.tile_size, &tuning.unroll, name
+    ) == 6)
+        if (low <= bodies_count && bodies_count <= high && strcmp(name, device_name) == 0)
+            *result = tuning;
+
+    fclose(tuning_file);
+}
+
+static cl_int device_create(Device *device, const char *kernel_file_name, NBodiesSimulation *simulation)
+{
+    cl_device_id device_id;
+    cl_int status = get_device_id(&device_id);
+    if (status != CL_SUCCESS)
+        return status;
+
+    device->context = clCreateContext(0, 1, &device_id, NULL, NULL, &status);
+    if (status != CL_SUCCESS)
+        return status;
+    device->commands = clCreateCommandQueueWithProperties(device->context, device_id, NULL, &status);
+    if (status != CL_SUCCESS)
+        return status;
+
+    char *kernel_source = read_kernel_source(kernel_file_name);
+    if (!kernel_source)
+        return CL_INVALID_VALUE;
+    device->program = clCreateProgramWithSource(device->context, 1, (const char **) &kernel_source, NULL, &status);
+    free(kernel_source);
+    if (status != CL_SUCCESS)
+        return status;
+
+    char device_name[256], build_options[64];
+    Tuning tuning = { 64, 64, 1 };
+    status = clGetDeviceInfo(device_id, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+    if (status != CL_SUCCESS)
+        return status;
+    device_name[sizeof(device_name) - 1] = '\0';
+    load_tuning(device_name, simulation->bodies_count, &tuning);
+    sprintf(build_options, "-D TILE_SIZE=%d -D UNROLL=%d", tuning.tile_size, tuning.unroll);
+
+    status = clBuildProgram(device->program, 0, NULL, build_options, NULL, NULL);
+    if (status != CL_SUCCESS)
+        return status;
+    device->step_kernel = clCreateKernel(device->program, "step", &status);
+    if (status != CL_SUCCESS)
+        return status;
+
+    size_t max_work_group_size;
+    status = clGetDeviceInfo(device_id, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_work_group_size), &max_work_group_size, NULL);
+    if (status != CL_SUCCESS)
+        return status;
+    device->local_size = max_work_group_size < (size_t) tuning.local_size ? max_work_group_size : (size_t) tuning.local_size;
+
+    float g = simulation->gravitation_const,
+        body_radius = simulation->body_radius,
+        model_dt = simulation->model_delta_t;
+    int bodies_count = simulation->bodies_count;
+    device->parameters_mem[0] = clCreateBuffer(device->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float), &g, &status);
+    device->parameters_mem[1] = clCreateBuffer(device->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float), &body_radius, &status);
+    device->parameters_mem[2] = clCreateBuffer(device->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(int), &bodies_count, &status);
+    device->parameters_mem[3] = clCreateBuffer(device->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float), &model_dt, &status);
+    for (int b = 0; b < 2; ++b)
+        device->bodies_mem[b] = clCreateBuffer(device->context, CL_MEM_READ_WRITE, bodies_count * sizeof(DeviceBody), NULL, &status);
+    for (cl_uint k = 0; k < 4; ++k)
+        status |= clSetKernelArg(device->step_kernel, k, sizeof(cl_mem), device->parameters_mem + k);
+
+    device->staging = malloc(bodies_count * sizeof(DeviceBody) + 1);
+    if (!device->staging)
+        return CL_OUT_OF_HOST_MEMORY;
+    return status;
+}
+
+static void device_destroy(Device *device)
+{
+    for (int k = 0; k < 4; ++k)
+        if (device->parameters_mem[k])
+            clReleaseMemObject(device->parameters_mem[k]);
+    for (int b = 0; b < 2; ++b)
+        if (device->bodies_mem[b])
+            clReleaseMemObject(device->bodies_mem[b]);
+    if (device->step_kernel)
+        clReleaseKernel(device->step_kernel);
+    if (device->program)
+        clReleaseProgram(device->program);
+    if (device->commands)
+        clReleaseCommandQueue(device->commands);
+    if (device->context)
+        clReleaseContext(device->context);
+    free(device->staging);
+}
+
+// bodies go to the device once per call, all steps run there, results come back once
+static cl_int device_step(NBodiesSimulation *simulation, int steps)
+{
+    Device *device = &simulation->device;
+    int bodies_count = simulation->bodies_count;
+    size_t bodies_size = bodies_count * sizeof(DeviceBody);
+
+    for (int i = 0; i < bodies_count; ++i) {
+        NBodiesBody body = simulation->bodies[i];
+        DeviceBody device_body = {
+            { body.position.x, body.position.y, body.position.z },
+            { body.velocity.x, body.velocity.y, body.velocity.z },
+            body.mass
+        };
+        device->staging[i] = device_body;
+    }
+
+    cl_int status = clEnqueueWriteBuffer(device->commands, device->bodies_mem[0], CL_FALSE, 0, bodies_size, device->staging, 0, NULL, NULL);
+    size_t global_work_size[] = { (bodies_count + device->local_size - 1) / device->local_size * device->local_size },
+        local_work_size[] = { device->local_size };
+    for (int step = 0; step < steps; ++step) {
+        status |= clSetKernelArg(device->step_kernel, 4u, sizeof(cl_mem), device->bodies_mem + step % 2);
+        status |= clSetKernelArg(device->step_kernel, 5u, sizeof(cl_mem), device->bodies_mem + (step + 1) % 2);
+        status |= clEnqueueNDRangeKernel(device->commands, device->step_kernel, 1, NULL, global_work_size, local_work_size, 0u, NULL, NULL);
+    }
+    status |= clEnqueueReadBuffer(device->commands, device->bodies_mem[steps % 2], CL_TRUE, 0, bodies_size, device->staging, 0, NULL, NULL);
+    if (status != CL_SUCCESS)
+        return status;
+
+    for (int i = 0; i < bodies_count; ++i) {
+        DeviceBody device_body = device->staging[i];
+        NBodiesBody body = {
+            { device_body.position.x, device_body.position.y, device_body.position.z },
+            { device_body.velocity.x, device_body.velocity.y, device_body.velocity.z },
+            device_body.mass
+        };
+        simulation->bodies[i] = body;
+    }
+    return status;
+}
+#endif
+
+NBodiesSimulation *n_bodies_simulation_create(
+    NBodiesBackend backend,
+    double gravitation_const, double body_radius, double model_delta_t,
+    int bodies_count, const NBodiesBody *bodies,
+    const char *kernel_file_name
+)
+{
+    if (backend != N_BODIES_BACKEND_SEQUENTIAL && backend != N_BODIES_BACKEND_OPEN_MP && backend != N_BODIES_BACKEND_OPENCL)
+        return NULL;
+#ifndef WITH_OPENCL
+    if (backend == N_BODIES_BACKEND_OPENCL)
+        return NULL;
+#endif
+    if (bodies_count < 0)
+        return NULL;
+
+    NBodiesSimulation *simulation = calloc(1, sizeof(NBodiesSimulation));
+    if (!simulation)
+        return NULL;
+    simulation->backend = backend;
+    simulation->gravitation_const = gravitation_const;
+    simulation->body_radius = body_radius;
+    simulation->model_delta_t = model_delta_t;
+    simulation->bodies_count = bodies_count;
+    simulation->bodies = malloc(bodies_count * sizeof(NBodiesBody) + 1);
+    simulation->velocities = malloc(bodies_count * sizeof(NBodiesVector3) + 1);
+    if (!simulation->bodies || !simulation->velocities) {
+        n_bodies_simulation_destroy(simulation);
+        return NULL;
+    }
+    memcpy(simulation->bodies, bodies, bodies_count * sizeof(NBodiesBody));
+
+#ifdef WITH_OPENCL
+    if (backend == N_BODIES_BACKEND_OPENCL && device_create(&simulation->device, kernel_file_name, simulation) != CL_SUCCESS) {
+        n_bodies_simulation_destroy(simulation);
+        return NULL;
+    }
+#else
+    (void) kernel_file_name;
+#endif
+
+    return simulation;
+}
+
+int n_bodies_simulation_step(NBodiesSimulation *simulation, int steps)
+{
+    if (steps <= 0)
+        return 0;
+#ifdef WITH_OPENCL
+    if (simulation->backend == N_BODIES_BACKEND_OPENCL)
+        return device_step(simulation, steps) == CL_SUCCESS ? 0 : -1;
+#endif
+    for (int step = 0; step < steps; ++step)
+        cpu_step(simulation);
+    return 0;
+}
+
+NBodiesBody *n_bodies_simulation_bodies(NBodiesSimulation *simulation)
+{
+    return simulation->bodies;
+}
+
+int n_bodies_simulation_bodies_count(const NBodiesSimulation *simulation)
+{
+    return simulation->bodies_count;
+}
+
+void n_bodies_simulation_destroy(NBodiesSimulation *simulation)
+{
+    if (!simulation)
+        return;
+#ifdef WITH_OPENCL
+    if (simulation->backend == N_BODIES_BACKEND_OPENCL)
+        device_destroy(&simulation->device);
+#endif
+    free(simulation->bodies);
+    free(simulation->velocities);
+    free(simulation);
+}
@@ -0,0 +1,60 @@
+#ifndef N_BODIES_H
+#define N_BODIES_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct NBodiesVector3 {
+    double x;
+    double y;
+    double z;
+} NBodiesVector3;
+
+typedef struct NBodiesBody {
+    NBodiesVector3 position;
+    NBodiesVector3 velocity;
+    double mass;
+} NBodiesBody;
+
+typedef enum NBodiesBackend {
+    N_BODIES_BACKEND_SEQUENTIAL,
+    N_BODIES_BACKEND_OPEN_MP,
+    N_BODIES_BACKEND_OPENCL // only when the library is built with -D WITH_OPENCL
+} NBodiesBackend;
+
+typedef struct NBodiesSimulation NBodiesSimulation;
+
+/*
+ * Copies bodies into a new simulation. kernel_file_name is the path to
+ * opencl/n-bodies.cl and is used by the OpenCL backend only, which also takes
+ * its kernel parameters from n-bodies.tuning in the current directory if the
+ * device was tuned there by the OpenCL program.
+ * The device is chosen by N_BODIES_DEVICE the same way as in the OpenCL program.
+ * Returns NULL if the backend is unknown or not available.
+ */
+NBodiesSimulation *n_bodies_simulation_create(
+    NBodiesBackend backend,
+    double gravitation_const, double body_radius, double model_delta_t,
+    int bodies_count, const NBodiesBody *bodies,
+    const char *kernel_file_name
+);
+
+// makes the given number of steps, returns 0 on success
+int n_bodies_simulation_step(NBodiesSimulation *simulation, int steps);
+
+/*
+ * Bodies of the simulation, not a copy. They may be read and changed between
+ * calls to n_bodies_simulation_step, changes are taken into account by the next step.
+ */
+NBodiesBody *n_bodies_simulation_bodies(NBodiesSimulation *simulation);
+
+int n_bodies_simulation_bodies_count(const NBodiesSimulation *simulation);
+
+void n_bodies_simulation_destroy(NBodiesSimulation *simulation);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
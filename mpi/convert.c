@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Converts between the text and the binary formats of mpi/n-bodies.c.
+ * Binary: G r dt as doubles, n steps as ints, then n records of
+ * 7 doubles (mass, position, velocity).
+ */
+
+void write_body(FILE *stream, double *record)
+{
+    fprintf(
+        stream, "body {\n\t'mass': %lf\n\t'position': (%lf, %lf, %lf)\n\t'velocity': (%lf, %lf, %lf)\n}",
+        record[0], record[1], record[2], record[3], record[4], record[5], record[6]
+    );
+}
+
+// task.txt -> task.bin
+int to_binary(FILE *text_file, FILE *binary_file)
+{
+    double g_radius_dt[3], record[7];
+    int bcount_steps[2];
+    if (fscanf(
+        text_file, "%lf %lf %lf %d %d",
+        g_radius_dt, g_radius_dt + 1, g_radius_dt + 2,
+        bcount_steps, bcount_steps + 1
+    ) != 5)
+        return 1;
+
+    fwrite(g_radius_dt, sizeof(double), 3, binary_file);
+    fwrite(bcount_steps, sizeof(int), 2, binary_file);
+    for (int i = 0; i < bcount_steps[0]; ++i) {
+        for (int k = 0; k < 7; ++k)
+            if (fscanf(text_file, "%lf", record + k) != 1)
+                return 1;
+        fwrite(record, sizeof(double), 7, binary_file);
+    }
+    return 0;
+}
+
+// solution.bin -> solution.txt in the format of the other programs
+int to_text(FILE *binary_file, FILE *text_file)
+{
+    double g_radius_dt[3], record[7];
+    int bcount_steps[2];
+    if (
+        fread(g_radius_dt, sizeof(double), 3, binary_file) != 3
+        || fread(bcount_steps, sizeof(int), 2, binary_file) != 2
+    )
+        return 1;
+
+    for (int i = 0; i < bcount_steps[0]; ++i) {
+        if (fread(record, sizeof(double), 7, binary_file) != 7)
+            return 1;
+        write_body(text_file, record);
+        fprintf(text_file, "\n");
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 4 || (strcmp(argv[1], "to-binary") != 0 && strcmp(argv[1], "to-text") != 0)) {
+        fprintf(stderr, "Usage: %s to-binary|to-text input output\n", argv[0]);
+        return 1;
+    }
+
+    int binary = strcmp(argv[1], "to-binary") == 0;
+    FILE *input = fopen(argv[2], binary ? "r" : "rb"),
+        *output = fopen(argv[3], binary ? "wb" : "w");
+    if (!input || !output) {
+        fprintf(stderr, "Error: Could not open files\n");
+        return 1;
+    }
+
+    int status = binary ? to_binary(input, output) : to_text(input, output);
+    fclose(input);
+    fclose(output);
+    if (status != 0)
+        fprintf(stderr, "Error: Malformed input\n");
+    return status;
+}
@@ -1,6 +1,8 @@
 #include <mpi.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stddef.h>
 
 #define MASTER_RANK 0
@@ -99,21 +101,136 @@ Vector3 induced_acceleration(
     return multiply(body_2.mass, density);
 }
 
+/*
+ * Potential energy of two unit masses, consistent with gravity_density:
+ * -G / d outside of body_radius and the integral of the repulsion inside.
+ */
+double pair_potential(double gravitation_const, double body_radius, double distance)
+{
+    if (distance > body_radius)
+        return -gravitation_const / distance;
+    return gravitation_const / (2.0 * distance * distance)
+        - gravitation_const / body_radius
+        - gravitation_const / (2.0 * body_radius * body_radius);
+}
+
+// induced_acceleration that also gives the potential energy of the pair, the distance is computed once
+Vector3 induced_acceleration_potential(
+    double gravitation_const, double body_radius,
+    Body body_1, Body body_2, double *energy
+)
+{
+    Vector3 delta_r = minus(body_2.position, body_1.position);
+    double distance = absolute(delta_r);
+    double denominator = distance > body_radius ? pow(distance, 2.0) : -pow(distance, 3.0);
+    double abs_density = gravitation_const / denominator;
+    Vector3 density = {
+        abs_density * delta_r.x / distance,
+        abs_density * delta_r.y / distance,
+        abs_density * delta_r.z / distance
+    };
+    *energy = body_1.mass * body_2.mass * pair_potential(gravitation_const, body_radius, distance);
+    return multiply(body_2.mass, density);
+}
+
+// 8 doubles, reduced with MPI_SUM as is
+typedef struct Diagnostics {
+    double kinetic;
+    double potential;
+    Vector3 momentum;
+    Vector3 angular_momentum; // about the origin
+} Diagnostics;
+
+// adds the kinetic energy and the momenta of the bodies
+void diagnose(int bodies_count, Body *bodies, Diagnostics *diagnostics)
+{
+    for (int i = 0; i < bodies_count; ++i) {
+        Vector3 r = bodies[i].position,
+            p = multiply(bodies[i].mass, bodies[i].velocity);
+        diagnostics->kinetic += (p.x * bodies[i].velocity.x + p.y * bodies[i].velocity.y + p.z * bodies[i].velocity.z) / 2.0;
+        diagnostics->momentum = plus(diagnostics->momentum, p);
+        diagnostics->angular_momentum.x += r.y * p.z - r.z * p.y;
+        diagnostics->angular_momentum.y += r.z * p.x - r.x * p.z;
+        diagnostics->angular_momentum.z += r.x * p.y - r.y * p.x;
+    }
+}
+
+// one line per record, drift is relative to the energy of step 0
+void write_diagnostics(FILE *log_file, int step, Diagnostics *diagnostics, double initial_energy)
+{
+    double energy = diagnostics->kinetic + diagnostics->potential,
+        drift = initial_energy != 0.0 ? (energy - initial_energy) / fabs(initial_energy) : energy;
+    fprintf(
+        log_file, "%d %.9e %.9e %.9e %.3e %.9e %.9e %.9e %.9e %.9e %.9e\n",
+        step, diagnostics->kinetic, diagnostics->potential, energy, drift,
+        diagnostics->momentum.x, diagnostics->momentum.y, diagnostics->momentum.z,
+        diagnostics->angular_momentum.x, diagnostics->angular_momentum.y, diagnostics->angular_momentum.z
+    );
+    fflush(log_file);
+}
+
+/*
+ * Sums local diagnostics of all processes on the master, which writes them
+ * to log_file. initial_energy is set on step 0.
+ * accelerate adds the accelerations without dt, so the energy conserved by
+ * the step is K + U / dt and the potential is divided by model_delta_t.
+ */
+void reduce_diagnostics(
+    int p_rank, int step, double model_delta_t, Diagnostics *local, FILE *log_file, double *initial_energy
+)
+{
+    Diagnostics total;
+    MPI_Reduce(local, &total, sizeof(Diagnostics) / sizeof(double), MPI_DOUBLE, MPI_SUM, MASTER_RANK, MPI_COMM_WORLD);
+    if (p_rank != MASTER_RANK)
+        return;
+    total.potential /= model_delta_t;
+    if (step == 0)
+        *initial_energy = total.kinetic + total.potential;
+    write_diagnostics(log_file, step, &total, *initial_energy);
+}
+
+// bodies owned by a process, in the order of the space-filling curve
+typedef struct Particle {
+    Body body;
+    double cost; // time spent on the interactions of this body during the last step
+    unsigned long long key; // Morton key
+    int index; // position in the task file
+} Particle;
+
 void accelerate(
     double gravitation_const, double body_radius,
     int bodies_count, Body *bodies,
-    int offset, int subtask_size
+    int offset, int subtask_size, double *costs, double *potential
 )
 {
-    for (int i = offset; i < offset + subtask_size; ++i)
-        for (int j = 0; j < bodies_count; ++j)
-            if (i != j)
-                bodies[i].velocity = plus(
-                    bodies[i].velocity,
-                    induced_acceleration(
-                        gravitation_const, body_radius, bodies[i], bodies[j]
-                    )
-                );
+    // costs are measured only if they are not NULL
+    for (int i = offset; i < offset + subtask_size; ++i) {
+        double begin = costs != NULL ? MPI_Wtime() : 0.0;
+        if (potential == NULL) {
+            for (int j = 0; j < bodies_count; ++j)
+                if (i != j)
+                    bodies[i].velocity = plus(
+                        bodies[i].velocity,
+                        induced_acceleration(
+                            gravitation_const, body_radius, bodies[i], bodies[j]
+                        )
+                    );
+        } else
+            for (int j = 0; j < bodies_count; ++j)
+                if (i != j) {
+                    double energy;
+                    bodies[i].velocity = plus(
+                        bodies[i].velocity,
+                        induced_acceleration_potential(
+                            gravitation_const, body_radius, bodies[i], bodies[j], &energy
+                        )
+                    );
+                    // every pair is visited twice
+                    *potential += energy / 2.0;
+                }
+        if (costs != NULL)
+            costs[i - offset] = MPI_Wtime() - begin;
+    }
 }
 
 void get_subtask_parameters(
@@ -121,8 +238,9 @@ void get_subtask_parameters(
     int *offset, int *subtask_size
 )
 {
-    *subtask_size = bodies_count / world_size;    
-    *offset = p_rank * (*subtask_size);
+    int remainder = bodies_count % world_size;
+    *subtask_size = bodies_count / world_size + (p_rank < remainder);
+    *offset = p_rank * (bodies_count / world_size) + (p_rank < remainder ? p_rank : remainder);
 }
 
 void move(
@@ -136,98 +254,760 @@ void move(
 		);
 }
 
-void master_process(
-    MPI_Datatype mpi_body, int world_size,
-    char *task_file_name, char *solution_file_name
+unsigned long long spread_bits(unsigned long long v)
+{
+    v &= 0x1fffffull;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+// interleaves 21 bits of every coordinate, normalized to the bounding box
+unsigned long long morton_key(Vector3 position, Vector3 lower, Vector3 upper)
+{
+    const double scale = (double) 0x1fffff;
+    double coords[] = { position.x, position.y, position.z },
+        lowers[] = { lower.x, lower.y, lower.z },
+        uppers[] = { upper.x, upper.y, upper.z };
+    unsigned long long key = 0ull;
+    for (int d = 0; d < 3; ++d) {
+        double extent = uppers[d] - lowers[d],
+            normalized = extent > 0.0 ? (coords[d] - lowers[d]) / extent : 0.0;
+        key |= spread_bits((unsigned long long) (normalized * scale)) << d;
+    }
+    return key;
+}
+
+void compute_keys(int local_count, Particle *particles)
+{
+    // minimums of coordinates and of negated coordinates give the bounding box
+    double bounds[6] = { INFINITY, INFINITY, INFINITY, INFINITY, INFINITY, INFINITY };
+    for (int k = 0; k < local_count; ++k) {
+        Vector3 p = particles[k].body.position;
+        bounds[0] = fmin(bounds[0], p.x);
+        bounds[1] = fmin(bounds[1], p.y);
+        bounds[2] = fmin(bounds[2], p.z);
+        bounds[3] = fmin(bounds[3], -p.x);
+        bounds[4] = fmin(bounds[4], -p.y);
+        bounds[5] = fmin(bounds[5], -p.z);
+    }
+    MPI_Allreduce(MPI_IN_PLACE, bounds, 6, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
+
+    Vector3 lower = { bounds[0], bounds[1], bounds[2] },
+        upper = { -bounds[3], -bounds[4], -bounds[5] };
+    for (int k = 0; k < local_count; ++k)
+        particles[k].key = morton_key(particles[k].body.position, lower, upper);
+}
+
+typedef struct KeyPosition {
+    unsigned long long key;
+    int position;
+} KeyPosition;
+
+int compare_key_positions(const void *a, const void *b)
+{
+    const KeyPosition *p1 = a, *p2 = b;
+    if (p1->key != p2->key)
+        return p1->key < p2->key ? -1 : 1;
+    return p1->position - p2->position;
+}
+
+int compare_particles(const void *a, const void *b)
+{
+    const Particle *p1 = a, *p2 = b;
+    if (p1->key != p2->key)
+        return p1->key < p2->key ? -1 : 1;
+    return p1->index - p2->index;
+}
+
+// realloc of the owned particles to a new count, every process keeps only its own bodies
+Particle *resize_particles(Particle *particles, int count)
+{
+    particles = realloc(particles, count * sizeof(Particle) + 1);
+    if (!particles) {
+        fprintf(stderr, "Error: Could not allocate %d particles\n", count);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    return particles;
+}
+
+/*
+ * Orders all bodies along the Morton curve, cuts the curve into world_size pieces
+ * of equal measured cost and moves every body to the owner of its piece.
+ * counts and displs describe the distribution of bodies and are updated in place,
+ * particles is reallocated to the new local_count.
+ */
+void repartition(
+    MPI_Datatype mpi_particle, int world_size, int p_rank, int bodies_count,
+    int *local_count, Particle **particles,
+    int *counts, int *displs
 )
 {
-    double g_radius_dt[3]; // gravitation_const, body_radius, model_delta_t
-    int bcount_steps[2]; // bodies_count, simulation_steps
+    compute_keys(*local_count, *particles);
 
-    FILE *task_file = fopen(task_file_name, "r");
-    
-    fscanf(
-        task_file, "%lf %lf %lf %d %d",
-        g_radius_dt, g_radius_dt + 1, g_radius_dt + 2,
-        bcount_steps, bcount_steps + 1
+    unsigned long long *keys = malloc(bodies_count * sizeof(unsigned long long)),
+        *local_keys = malloc(*local_count * sizeof(unsigned long long) + 1);
+    double *costs = malloc(bodies_count * sizeof(double)),
+        *local_costs = malloc(*local_count * sizeof(double) + 1);
+    for (int k = 0; k < *local_count; ++k) {
+        local_keys[k] = (*particles)[k].key;
+        local_costs[k] = (*particles)[k].cost;
+    }
+    MPI_Allgatherv(local_keys, *local_count, MPI_UNSIGNED_LONG_LONG, keys, counts, displs, MPI_UNSIGNED_LONG_LONG, MPI_COMM_WORLD);
+    MPI_Allgatherv(local_costs, *local_count, MPI_DOUBLE, costs, counts, displs, MPI_DOUBLE, MPI_COMM_WORLD);
+
+    KeyPosition *order = malloc(bodies_count * sizeof(KeyPosition));
+    double total_cost = 0.0;
+    for (int i = 0; i < bodies_count; ++i) {
+        order[i].key = keys[i];
+        order[i].position = i;
+        total_cost += costs[i];
+    }
+    qsort(order, bodies_count, sizeof(KeyPosition), compare_key_positions);
+
+    // every process computes the same assignment, so no counts have to be exchanged
+    int *owners = malloc(bodies_count * sizeof(int)),
+        *parts = malloc(bodies_count * sizeof(int)),
+        send_counts[world_size], send_displs[world_size],
+        recv_counts[world_size], recv_displs[world_size], new_counts[world_size];
+    for (int r = 0; r < world_size; ++r) {
+        send_counts[r] = recv_counts[r] = new_counts[r] = 0;
+        for (int k = displs[r]; k < displs[r] + counts[r]; ++k)
+            owners[k] = r;
+    }
+
+    double prefix_cost = 0.0;
+    for (int i = 0; i < bodies_count; ++i) {
+        int position = order[i].position;
+        double cost = costs[position];
+        int part = total_cost > 0.0 ?
+            (int) ((prefix_cost + cost / 2.0) * world_size / total_cost) :
+            (int) ((long long) i * world_size / bodies_count);
+        if (part >= world_size)
+            part = world_size - 1;
+        prefix_cost += cost;
+
+        parts[i] = part;
+        ++new_counts[part];
+        if (owners[position] == p_rank)
+            ++send_counts[part];
+        if (part == p_rank)
+            ++recv_counts[owners[position]];
+    }
+
+    send_displs[0] = recv_displs[0] = 0;
+    for (int r = 1; r < world_size; ++r) {
+        send_displs[r] = send_displs[r - 1] + send_counts[r - 1];
+        recv_displs[r] = recv_displs[r - 1] + recv_counts[r - 1];
+    }
+
+    // fill the send buffer in curve order
+    Particle *send_buff = malloc(*local_count * sizeof(Particle) + 1);
+    int filled[world_size];
+    for (int r = 0; r < world_size; ++r)
+        filled[r] = 0;
+    for (int i = 0; i < bodies_count; ++i) {
+        int position = order[i].position;
+        if (owners[position] != p_rank)
+            continue;
+        int part = parts[i];
+        send_buff[send_displs[part] + filled[part]++] = (*particles)[position - displs[p_rank]];
+    }
+
+    *local_count = new_counts[p_rank];
+    *particles = resize_particles(*particles, *local_count);
+    MPI_Alltoallv(
+        send_buff, send_counts, send_displs, mpi_particle,
+        *particles, recv_counts, recv_displs, mpi_particle, MPI_COMM_WORLD
     );
-    
-    Body bodies[bcount_steps[0]];
-    for (int i = 0; i < bcount_steps[0]; ++i)
-        bodies[i] = read_body(task_file);
-    
-    fclose(task_file);
-    
-    // broadcast parameters
+    qsort(*particles, *local_count, sizeof(Particle), compare_particles);
+
+    displs[0] = 0;
+    for (int r = 0; r < world_size; ++r) {
+        counts[r] = new_counts[r];
+        if (r > 0)
+            displs[r] = displs[r - 1] + counts[r - 1];
+    }
+
+    free(send_buff);
+    free(keys);
+    free(local_keys);
+    free(costs);
+    free(local_costs);
+    free(order);
+    free(owners);
+    free(parts);
+}
+
+// reduces the first element of every pair with maximum and the second with sum
+void max_sum(void *in, void *inout, int *length, MPI_Datatype *type)
+{
+    double *a = in, *b = inout;
+    (void) type;
+    for (int k = 0; k + 1 < *length; k += 2) {
+        b[k] = a[k] > b[k] ? a[k] : b[k];
+        b[k + 1] += a[k + 1];
+    }
+}
+
+/*
+ * Step loop shared by all processes. Every process owns local_count particles,
+ * positions of all bodies are gathered before each step.
+ * With rebalancing the costs of bodies are measured, and the load imbalance
+ * (maximum over mean of the acceleration time) is printed by the master.
+ */
+void simulate(
+    MPI_Datatype mpi_body, MPI_Datatype mpi_particle,
+    int world_size, int p_rank,
+    double *g_radius_dt, int *bcount_steps, int rebalance_interval,
+    int diagnostics_interval, FILE *log_file,
+    int *local_count, Particle **particles, int *counts, int *displs
+)
+{
+    int bodies_count = bcount_steps[0];
+    double initial_energy = 0.0;
+    Body *bodies = malloc(bodies_count * sizeof(Body)),
+        *body_buff = malloc(bodies_count * sizeof(Body));
+    double *costs = malloc(bodies_count * sizeof(double));
+    int balanced = rebalance_interval > 0;
+    MPI_Op max_sum_op;
+    if (balanced)
+        MPI_Op_create(max_sum, 1, &max_sum_op);
+
+    for (int step = 0; step < bcount_steps[1]; ++step) {
+        if (balanced && step % rebalance_interval == 0)
+            repartition(
+                mpi_particle, world_size, p_rank, bodies_count,
+                local_count, particles, counts, displs
+            );
+
+        for (int k = 0; k < *local_count; ++k)
+            body_buff[k] = (*particles)[k].body;
+        MPI_Allgatherv(body_buff, *local_count, mpi_body, bodies, counts, displs, mpi_body, MPI_COMM_WORLD);
+
+        Diagnostics diagnostics = { 0.0, 0.0, { 0.0, 0.0, 0.0 }, { 0.0, 0.0, 0.0 } };
+        int diagnosed = diagnostics_interval > 0 && step % diagnostics_interval == 0;
+        if (diagnosed)
+            diagnose(*local_count, bodies + displs[p_rank], &diagnostics);
+
+        double begin = MPI_Wtime();
+        accelerate(
+            g_radius_dt[0], g_radius_dt[1], bodies_count, bodies, displs[p_rank], *local_count,
+            balanced ? costs : NULL, diagnosed ? &diagnostics.potential : NULL
+        );
+        double compute_time[2]; // maximum, sum
+        compute_time[0] = compute_time[1] = MPI_Wtime() - begin;
+
+        for (int k = 0; k < *local_count; ++k)
+            body_buff[k] = bodies[displs[p_rank] + k];
+        move(g_radius_dt[2], *local_count, body_buff);
+        for (int k = 0; k < *local_count; ++k)
+            (*particles)[k].body = body_buff[k];
+
+        if (balanced) {
+            for (int k = 0; k < *local_count; ++k)
+                (*particles)[k].cost = costs[k];
+            double reduced[2];
+            MPI_Reduce(compute_time, reduced, 2, MPI_DOUBLE, max_sum_op, MASTER_RANK, MPI_COMM_WORLD);
+            if (p_rank == MASTER_RANK && reduced[1] > 0.0)
+                fprintf(stderr, "Step %d: load imbalance %lf\n", step, reduced[0] * world_size / reduced[1]);
+        }
+        if (diagnosed)
+            reduce_diagnostics(p_rank, step, g_radius_dt[2], &diagnostics, log_file, &initial_energy);
+    }
+
+    free(bodies);
+    free(body_buff);
+    free(costs);
+    if (balanced)
+        MPI_Op_free(&max_sum_op);
+}
+
+int compare_indices(const void *a, const void *b)
+{
+    const Particle *p1 = a, *p2 = b;
+    return p1->index - p2->index;
+}
+
+/*
+ * Moves every particle to the process owners[index], local_count is updated
+ * and particles is reallocated to it. Received particles are sorted by index.
+ */
+void migrate(
+    MPI_Datatype mpi_particle, int world_size, int *owners,
+    int *local_count, Particle **particles
+)
+{
+    int send_counts[world_size], send_displs[world_size],
+        recv_counts[world_size], recv_displs[world_size],
+        filled[world_size];
+    for (int r = 0; r < world_size; ++r)
+        send_counts[r] = filled[r] = 0;
+    for (int k = 0; k < *local_count; ++k)
+        ++send_counts[owners[(*particles)[k].index]];
+    MPI_Alltoall(send_counts, 1, MPI_INT, recv_counts, 1, MPI_INT, MPI_COMM_WORLD);
+
+    send_displs[0] = recv_displs[0] = 0;
+    for (int r = 1; r < world_size; ++r) {
+        send_displs[r] = send_displs[r - 1] + send_counts[r - 1];
+        recv_displs[r] = recv_displs[r - 1] + recv_counts[r - 1];
+    }
+
+    Particle *send_buff = malloc(*local_count * sizeof(Particle) + 1);
+    for (int k = 0; k < *local_count; ++k) {
+        int owner = owners[(*particles)[k].index];
+        send_buff[send_displs[owner] + filled[owner]++] = (*particles)[k];
+    }
+
+    *local_count = recv_displs[world_size - 1] + recv_counts[world_size - 1];
+    *particles = resize_particles(*particles, *local_count);
+    MPI_Alltoallv(
+        send_buff, send_counts, send_displs, mpi_particle,
+        *particles, recv_counts, recv_displs, mpi_particle, MPI_COMM_WORLD
+    );
+    qsort(*particles, *local_count, sizeof(Particle), compare_indices);
+    free(send_buff);
+}
+
+/*
+ * Force decomposition on a grid_side x grid_side grid of processes. Bodies are
+ * split by index into grid_side groups, group g is owned by the diagonal process (g, g).
+ * Process (row, column) computes the accelerations of the row group induced by
+ * the column group, partial sums are reduced along the row to the diagonal,
+ * which moves its bodies and broadcasts them along its row and column.
+ * Every process exchanges O(bodies_count / grid_side) bodies per step.
+ */
+void simulate_2d(
+    MPI_Datatype mpi_body, MPI_Datatype mpi_particle,
+    int world_size, int p_rank, int grid_side,
+    double *g_radius_dt, int *bcount_steps,
+    int diagnostics_interval, FILE *log_file,
+    int *local_count, Particle **particles, int *counts, int *displs
+)
+{
+    double initial_energy = 0.0;
+    int bodies_count = bcount_steps[0],
+        dims[] = { grid_side, grid_side }, periods[] = { 0, 0 },
+        remain_row[] = { 0, 1 }, remain_column[] = { 1, 0 }, coords[2];
+    MPI_Comm grid, row_comm, column_comm;
+    MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 0, &grid);
+    MPI_Cart_coords(grid, p_rank, 2, coords);
+    MPI_Cart_sub(grid, remain_row, &row_comm); // rank in a row is the column
+    MPI_Cart_sub(grid, remain_column, &column_comm); // rank in a column is the row
+    int row = coords[0], column = coords[1];
+
+    int *owners = malloc(bodies_count * sizeof(int));
+    for (int g = 0; g < grid_side; ++g) {
+        int diagonal_coords[] = { g, g }, owner, offset, size;
+        MPI_Cart_rank(grid, diagonal_coords, &owner);
+        get_subtask_parameters(bodies_count, grid_side, g, &offset, &size);
+        for (int i = offset; i < offset + size; ++i)
+            owners[i] = owner;
+    }
+    migrate(mpi_particle, world_size, owners, local_count, particles);
+    free(owners);
+
+    MPI_Allgather(local_count, 1, MPI_INT, counts, 1, MPI_INT, MPI_COMM_WORLD);
+    displs[0] = 0;
+    for (int r = 1; r < world_size; ++r)
+        displs[r] = displs[r - 1] + counts[r - 1];
+
+    int row_offset, row_size, column_offset, column_size;
+    get_subtask_parameters(bodies_count, grid_side, row, &row_offset, &row_size);
+    get_subtask_parameters(bodies_count, grid_side, column, &column_offset, &column_size);
+    Body *row_bodies = malloc(row_size * sizeof(Body) + 1),
+        *column_bodies = malloc(column_size * sizeof(Body) + 1);
+    Vector3 *partial = malloc(row_size * sizeof(Vector3) + 1),
+        *total = malloc(row_size * sizeof(Vector3) + 1);
+
+    for (int step = 0; step < bcount_steps[1]; ++step) {
+        if (row == column)
+            for (int k = 0; k < row_size; ++k)
+                row_bodies[k] = column_bodies[k] = (*particles)[k].body;
+        MPI_Bcast(row_bodies, row_size, mpi_body, row, row_comm);
+        MPI_Bcast(column_bodies, column_size, mpi_body, column, column_comm);
+
+        // the diagonal adds the bodies of its group, every process adds the potential of its block
+        Diagnostics diagnostics = { 0.0, 0.0, { 0.0, 0.0, 0.0 }, { 0.0, 0.0, 0.0 } };
+        int diagnosed = diagnostics_interval > 0 && step % diagnostics_interval == 0;
+        if (diagnosed && row == column)
+            diagnose(row_size, row_bodies, &diagnostics);
+
+        for (int i = 0; i < row_size; ++i) {
+            Vector3 acceleration = { 0.0, 0.0, 0.0 };
+            for (int j = 0; j < column_size; ++j)
+                if (row_offset + i == column_offset + j)
+                    continue;
+                else if (diagnosed) {
+                    double energy;
+                    acceleration = plus(
+                        acceleration,
+                        induced_acceleration_potential(
+                            g_radius_dt[0], g_radius_dt[1], row_bodies[i], column_bodies[j], &energy
+                        )
+                    );
+                    // every pair is visited twice
+                    diagnostics.potential += energy / 2.0;
+                } else
+                    acceleration = plus(
+                        acceleration,
+                        induced_acceleration(
+                            g_radius_dt[0], g_radius_dt[1], row_bodies[i], column_bodies[j]
+                        )
+                    );
+            partial[i] = acceleration;
+        }
+        if (diagnosed)
+            reduce_diagnostics(p_rank, step, g_radius_dt[2], &diagnostics, log_file, &initial_energy);
+        MPI_Reduce(partial, total, 3 * row_size, MPI_DOUBLE, MPI_SUM, row, row_comm);
+
+        if (row == column) {
+            for (int k = 0; k < row_size; ++k)
+                row_bodies[k].velocity = plus(row_bodies[k].velocity, total[k]);
+            move(g_radius_dt[2], row_size, row_bodies);
+            for (int k = 0; k < row_size; ++k)
+                (*particles)[k].body = row_bodies[k];
+        }
+    }
+
+    free(row_bodies);
+    free(column_bodies);
+    free(partial);
+    free(total);
+    MPI_Comm_free(&row_comm);
+    MPI_Comm_free(&column_comm);
+    MPI_Comm_free(&grid);
+}
+
+#define BINARY_HEADER_SIZE (3 * sizeof(double) + 2 * sizeof(int))
+#define BINARY_RECORD_LENGTH 7 // mass, position, velocity
+
+/*
+ * Binary tasks and solutions: G r dt as doubles, n steps as ints,
+ * then n records of 7 doubles in the order of the text format.
+ */
+int is_binary(char *file_name)
+{
+    size_t length = strlen(file_name);
+    return length > 4 && strcmp(file_name + length - 4, ".bin") == 0;
+}
+
+void body_to_record(Body body, double *record)
+{
+    double values[] = {
+        body.mass,
+        body.position.x, body.position.y, body.position.z,
+        body.velocity.x, body.velocity.y, body.velocity.z
+    };
+    memcpy(record, values, sizeof(values));
+}
+
+Body record_to_body(double *record)
+{
+    Body body = {
+        { record[1], record[2], record[3] },
+        { record[4], record[5], record[6] },
+        record[0]
+    };
+    return body;
+}
+
+// process that gets the body with this index from get_subtask_parameters
+int subtask_owner(int bodies_count, int world_size, int index)
+{
+    int size = bodies_count / world_size,
+        remainder = bodies_count % world_size;
+    if (index < remainder * (size + 1))
+        return index / (size + 1);
+    return remainder + (index - remainder * (size + 1)) / size;
+}
+
+// file errors are returned by default rather than fatal, one failed process stops them all
+void check_file_error(int error, char *file_name)
+{
+    if (error == MPI_SUCCESS)
+        return;
+    char message[MPI_MAX_ERROR_STRING];
+    int length;
+    MPI_Error_string(error, message, &length);
+    fprintf(stderr, "Error: %s: %s\n", file_name, message);
+    MPI_Abort(MPI_COMM_WORLD, 1);
+}
+
+// the master reads the header, every process reads its own slice of records collectively
+void read_task_binary(
+    int world_size, int p_rank, char *task_file_name,
+    double *g_radius_dt, int *bcount_steps,
+    int *local_count, Particle **particles, int *counts, int *displs
+)
+{
+    MPI_File task_file;
+    check_file_error(
+        MPI_File_open(MPI_COMM_WORLD, task_file_name, MPI_MODE_RDONLY, MPI_INFO_NULL, &task_file),
+        task_file_name
+    );
+
+    // a read past the end of the file is not an error, so the size is checked up front
+    if (p_rank == MASTER_RANK) {
+        MPI_Offset file_size;
+        check_file_error(MPI_File_get_size(task_file, &file_size), task_file_name);
+        if (file_size >= (MPI_Offset) BINARY_HEADER_SIZE) {
+            check_file_error(MPI_File_read_at(task_file, 0, g_radius_dt, 3, MPI_DOUBLE, MPI_STATUS_IGNORE), task_file_name);
+            check_file_error(
+                MPI_File_read_at(task_file, 3 * sizeof(double), bcount_steps, 2, MPI_INT, MPI_STATUS_IGNORE),
+                task_file_name
+            );
+        }
+        if (
+            file_size < (MPI_Offset) BINARY_HEADER_SIZE || bcount_steps[0] < 0 || bcount_steps[1] < 0 ||
+            file_size < (MPI_Offset) (BINARY_HEADER_SIZE + (size_t) bcount_steps[0] * BINARY_RECORD_LENGTH * sizeof(double))
+        ) {
+            fprintf(stderr, "Error: %s is truncated or malformed\n", task_file_name);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
     MPI_Bcast(g_radius_dt, 3, MPI_DOUBLE, MASTER_RANK, MPI_COMM_WORLD);
     MPI_Bcast(bcount_steps, 2, MPI_INT, MASTER_RANK, MPI_COMM_WORLD);
 
+    for (int r = 0; r < world_size; ++r)
+        get_subtask_parameters(bcount_steps[0], world_size, r, displs + r, counts + r);
+    *local_count = counts[p_rank];
+
+    double *records = malloc(*local_count * BINARY_RECORD_LENGTH * sizeof(double) + 1);
+    int error = MPI_File_read_at_all(
+        task_file, BINARY_HEADER_SIZE + (MPI_Offset) displs[p_rank] * BINARY_RECORD_LENGTH * sizeof(double),
+        records, *local_count * BINARY_RECORD_LENGTH, MPI_DOUBLE, MPI_STATUS_IGNORE
+    );
+    check_file_error(error, task_file_name);
+    MPI_File_close(&task_file);
+
+    // only the own bodies, repartition and migrate grow the array when more arrive
+    *particles = resize_particles(NULL, *local_count);
+    for (int k = 0; k < *local_count; ++k) {
+        (*particles)[k].body = record_to_body(records + k * BINARY_RECORD_LENGTH);
+        (*particles)[k].cost = 1.0;
+        (*particles)[k].key = 0ull;
+        (*particles)[k].index = displs[p_rank] + k;
+    }
+    free(records);
+}
+
+/*
+ * Bodies are sent back to the owners of their index slices, then every
+ * process writes its slice collectively. The master also writes the header.
+ */
+void write_solution_binary(
+    MPI_Datatype mpi_particle, int world_size, int p_rank, char *solution_file_name,
+    double *g_radius_dt, int *bcount_steps, int local_count, Particle **particles
+)
+{
+    int bodies_count = bcount_steps[0];
+    int *owners = malloc(bodies_count * sizeof(int));
+    for (int i = 0; i < bodies_count; ++i)
+        owners[i] = subtask_owner(bodies_count, world_size, i);
+    migrate(mpi_particle, world_size, owners, &local_count, particles);
+    free(owners);
+
     int offset, subtask_size;
-    get_subtask_parameters(bcount_steps[0], world_size, MASTER_RANK, &offset, &subtask_size);
-    Body body_buff[subtask_size];
+    get_subtask_parameters(bodies_count, world_size, p_rank, &offset, &subtask_size);
+    double *records = malloc(subtask_size * BINARY_RECORD_LENGTH * sizeof(double) + 1);
+    for (int k = 0; k < subtask_size; ++k)
+        body_to_record((*particles)[k].body, records + k * BINARY_RECORD_LENGTH);
 
-    double begin = MPI_Wtime(),
-        end;
+    MPI_File solution_file;
+    check_file_error(
+        MPI_File_open(MPI_COMM_WORLD, solution_file_name, MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL, &solution_file),
+        solution_file_name
+    );
+    check_file_error(
+        MPI_File_set_size(solution_file, BINARY_HEADER_SIZE + (MPI_Offset) bodies_count * BINARY_RECORD_LENGTH * sizeof(double)),
+        solution_file_name
+    );
+    if (p_rank == MASTER_RANK) {
+        check_file_error(MPI_File_write_at(solution_file, 0, g_radius_dt, 3, MPI_DOUBLE, MPI_STATUS_IGNORE), solution_file_name);
+        check_file_error(
+            MPI_File_write_at(solution_file, 3 * sizeof(double), bcount_steps, 2, MPI_INT, MPI_STATUS_IGNORE),
+            solution_file_name
+        );
+    }
+    int error = MPI_File_write_at_all(
+        solution_file, BINARY_HEADER_SIZE + (MPI_Offset) offset * BINARY_RECORD_LENGTH * sizeof(double),
+        records, subtask_size * BINARY_RECORD_LENGTH, MPI_DOUBLE, MPI_STATUS_IGNORE
+    );
+    check_file_error(error, solution_file_name);
+    check_file_error(MPI_File_close(&solution_file), solution_file_name);
 
-    for (int step = 0; step < bcount_steps[1]; ++step) {
-        MPI_Bcast(bodies, bcount_steps[0], mpi_body, MASTER_RANK, MPI_COMM_WORLD);
+    free(records);
+}
+
+void master_process(
+    MPI_Datatype mpi_body, MPI_Datatype mpi_particle, int world_size,
+    char *task_file_name, char *solution_file_name, int rebalance_interval, int grid_side,
+    int diagnostics_interval, char *log_file_name
+)
+{
+    double g_radius_dt[3]; // gravitation_const, body_radius, model_delta_t
+    int bcount_steps[2]; // bodies_count, simulation_steps
+    int counts[world_size], displs[world_size], local_count;
+    Particle *particles;
 
-        accelerate(g_radius_dt[0], g_radius_dt[1], bcount_steps[0], bodies, offset, subtask_size);
+    double io_begin = MPI_Wtime();
 
-        for (int i = 0; i < subtask_size; ++i)
-            body_buff[i] = bodies[offset + i];
-        MPI_Gather(body_buff, subtask_size, mpi_body, bodies, subtask_size, mpi_body, MASTER_RANK, MPI_COMM_WORLD);
+    if (is_binary(task_file_name)) {
+        read_task_binary(
+            world_size, MASTER_RANK, task_file_name, g_radius_dt, bcount_steps,
+            &local_count, &particles, counts, displs
+        );
+    } else {
+        FILE *task_file = fopen(task_file_name, "r");
+        
+        fscanf(
+            task_file, "%lf %lf %lf %d %d",
+            g_radius_dt, g_radius_dt + 1, g_radius_dt + 2,
+            bcount_steps, bcount_steps + 1
+        );
+        
+        Particle *all_particles = malloc(bcount_steps[0] * sizeof(Particle));
+        for (int i = 0; i < bcount_steps[0]; ++i) {
+            all_particles[i].body = read_body(task_file);
+            all_particles[i].cost = 1.0;
+            all_particles[i].key = 0ull;
+            all_particles[i].index = i;
+        }
+        
+        fclose(task_file);
+        
+        // broadcast parameters
+        MPI_Bcast(g_radius_dt, 3, MPI_DOUBLE, MASTER_RANK, MPI_COMM_WORLD);
+        MPI_Bcast(bcount_steps, 2, MPI_INT, MASTER_RANK, MPI_COMM_WORLD);
 
-        MPI_Scatter(bodies, subtask_size, mpi_body, body_buff, subtask_size, mpi_body, MASTER_RANK, MPI_COMM_WORLD);
+        for (int r = 0; r < world_size; ++r)
+            get_subtask_parameters(bcount_steps[0], world_size, r, displs + r, counts + r);
+        local_count = counts[MASTER_RANK];
+        particles = resize_particles(NULL, local_count);
+        MPI_Scatterv(all_particles, counts, displs, mpi_particle, particles, local_count, mpi_particle, MASTER_RANK, MPI_COMM_WORLD);
+        free(all_particles);
+    }
 
-        move(g_radius_dt[2], subtask_size, body_buff);
+    double begin = MPI_Wtime(),
+        end;
+    printf("Input taken: %lf sec\n", begin - io_begin);
 
-        MPI_Gather(body_buff, subtask_size, mpi_body, bodies, subtask_size, mpi_body, MASTER_RANK, MPI_COMM_WORLD);
+    FILE *log_file = NULL;
+    if (diagnostics_interval > 0) {
+        log_file = fopen(log_file_name, "w");
+        if (!log_file) {
+            fprintf(stderr, "Error: Could not open %s\n", log_file_name);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        fprintf(log_file, "# step kinetic potential total drift px py pz lx ly lz\n");
     }
 
+    if (grid_side > 0)
+        simulate_2d(
+            mpi_body, mpi_particle, world_size, MASTER_RANK, grid_side,
+            g_radius_dt, bcount_steps, diagnostics_interval, log_file,
+            &local_count, &particles, counts, displs
+        );
+    else
+        simulate(
+            mpi_body, mpi_particle, world_size, MASTER_RANK,
+            g_radius_dt, bcount_steps, rebalance_interval,
+            diagnostics_interval, log_file,
+            &local_count, &particles, counts, displs
+        );
+
     end = MPI_Wtime();
     printf("Time taken: %lf sec\n", end - begin);
 
-    FILE *solution_file = fopen(solution_file_name, "w");
-    for (int i = 0; i < bcount_steps[0]; ++i) {
-        write_body(solution_file, bodies[i]);
-        fprintf(solution_file, "\n");
+    if (is_binary(solution_file_name)) {
+        write_solution_binary(
+            mpi_particle, world_size, MASTER_RANK, solution_file_name,
+            g_radius_dt, bcount_steps, local_count, &particles
+        );
+    } else {
+        Particle *all_particles = malloc(bcount_steps[0] * sizeof(Particle));
+        MPI_Gatherv(particles, local_count, mpi_particle, all_particles, counts, displs, mpi_particle, MASTER_RANK, MPI_COMM_WORLD);
+
+        Body *bodies = malloc(bcount_steps[0] * sizeof(Body));
+        for (int i = 0; i < bcount_steps[0]; ++i)
+            bodies[all_particles[i].index] = all_particles[i].body;
+
+        FILE *solution_file = fopen(solution_file_name, "w");
+        for (int i = 0; i < bcount_steps[0]; ++i) {
+            write_body(solution_file, bodies[i]);
+            fprintf(solution_file, "\n");
+        }
+        fclose(solution_file);
+
+        free(all_particles);
+        free(bodies);
     }
+    printf("Output taken: %lf sec\n", MPI_Wtime() - end);
+
+    if (log_file)
+        fclose(log_file);
+
+    free(particles);
 }
 
 void slave_process(
     int p_rank, int world_size,
-    MPI_Datatype mpi_body
+    MPI_Datatype mpi_body, MPI_Datatype mpi_particle,
+    char *task_file_name, char *solution_file_name, int rebalance_interval, int grid_side,
+    int diagnostics_interval
 )
 {
+    FILE *log_file = NULL; // only the master writes diagnostics
     double g_radius_dt[3]; // gravitation_const, body_radius, model_delta_t
     int bcount_steps[2]; // bodies_count, simulation_steps
+    int counts[world_size], displs[world_size], local_count;
+    Particle *particles;
 
-    // receive parameters
-    MPI_Bcast(g_radius_dt, 3, MPI_DOUBLE, MASTER_RANK, MPI_COMM_WORLD);
-    MPI_Bcast(bcount_steps, 2, MPI_INT, MASTER_RANK, MPI_COMM_WORLD);
-
-    int offset, subtask_size;
-    get_subtask_parameters(bcount_steps[0], world_size, p_rank, &offset, &subtask_size);
-
-    Body bodies[bcount_steps[0]],
-        body_buff[subtask_size];
-
-    for (int step = 0; step < bcount_steps[1]; ++step) {
-        MPI_Bcast(bodies, bcount_steps[0], mpi_body, MASTER_RANK, MPI_COMM_WORLD);
+    if (is_binary(task_file_name)) {
+        read_task_binary(
+            world_size, p_rank, task_file_name, g_radius_dt, bcount_steps,
+            &local_count, &particles, counts, displs
+        );
+    } else {
+        // receive parameters
+        MPI_Bcast(g_radius_dt, 3, MPI_DOUBLE, MASTER_RANK, MPI_COMM_WORLD);
+        MPI_Bcast(bcount_steps, 2, MPI_INT, MASTER_RANK, MPI_COMM_WORLD);
 
-        accelerate(g_radius_dt[0], g_radius_dt[1], bcount_steps[0], bodies, offset, subtask_size);
+        for (int r = 0; r < world_size; ++r)
+            get_subtask_parameters(bcount_steps[0], world_size, r, displs + r, counts + r);
+        local_count = counts[p_rank];
 
-        for (int i = 0; i < subtask_size; ++i)
-            body_buff[i] = bodies[offset + i];
-        MPI_Gather(body_buff, subtask_size, mpi_body, bodies, subtask_size, mpi_body, MASTER_RANK, MPI_COMM_WORLD);
+        particles = resize_particles(NULL, local_count);
+        MPI_Scatterv(NULL, counts, displs, mpi_particle, particles, local_count, mpi_particle, MASTER_RANK, MPI_COMM_WORLD);
+    }
 
-        MPI_Scatter(bodies, subtask_size, mpi_body, body_buff, subtask_size, mpi_body, MASTER_RANK, MPI_COMM_WORLD);
+    if (grid_side > 0)
+        simulate_2d(
+            mpi_body, mpi_particle, world_size, p_rank, grid_side,
+            g_radius_dt, bcount_steps, diagnostics_interval, log_file,
+            &local_count, &particles, counts, displs
+        );
+    else
+        simulate(
+            mpi_body, mpi_particle, world_size, p_rank,
+            g_radius_dt, bcount_steps, rebalance_interval,
+            diagnostics_interval, log_file,
+            &local_count, &particles, counts, displs
+        );
 
-        move(g_radius_dt[2], subtask_size, body_buff);
+    if (is_binary(solution_file_name))
+        write_solution_binary(
+            mpi_particle, world_size, p_rank, solution_file_name,
+            g_radius_dt, bcount_steps, local_count, &particles
+        );
+    else
+        MPI_Gatherv(particles, local_count, mpi_particle, NULL, counts, displs, mpi_particle, MASTER_RANK, MPI_COMM_WORLD);
 
-        MPI_Gather(body_buff, subtask_size, mpi_body, bodies, subtask_size, mpi_body, MASTER_RANK, MPI_COMM_WORLD);
-    }
+    free(particles);
 }
 
 int main(int argc, char** argv)
@@ -236,7 +1016,7 @@ int main(int argc, char** argv)
 
     // create MPI type for Vector3
     const int n_items = 3;
-    int block_lengths[] = {1, 1, 1};
+    int block_lengths[] = {1, 1, 1, 1};
     MPI_Datatype types_vec3[] = { MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE },
         mpi_vector3;
     MPI_Aint offsets_vec3[] = {
@@ -254,20 +1034,58 @@ int main(int argc, char** argv)
     MPI_Type_create_struct(n_items, block_lengths, offsets_body, types_body, &mpi_body);
     MPI_Type_commit(&mpi_body);
 
+    // create mpi type for Particle, resized to cover the trailing padding
+    MPI_Datatype types_particle[] = { mpi_body, MPI_DOUBLE, MPI_UNSIGNED_LONG_LONG, MPI_INT },
+        mpi_particle_struct, mpi_particle;
+    MPI_Aint offsets_particle[] = {
+        offsetof(Particle, body), offsetof(Particle, cost),
+        offsetof(Particle, key), offsetof(Particle, index)
+    };
+    MPI_Type_create_struct(4, block_lengths, offsets_particle, types_particle, &mpi_particle_struct);
+    MPI_Type_create_resized(mpi_particle_struct, 0, sizeof(Particle), &mpi_particle);
+    MPI_Type_commit(&mpi_particle);
+
     int world_size, p_rank;
     MPI_Comm_size(MPI_COMM_WORLD, &world_size);
     MPI_Comm_rank(MPI_COMM_WORLD, &p_rank);
 
+    /*
+     * "2d" selects the force decomposition on a square grid of processes,
+     * otherwise bodies are repartitioned along the Morton curve every
+     * rebalance_interval steps, 0 disables it
+     */
+    int force_decomposition = argc > 3 && strcmp(argv[3], "2d") == 0,
+        rebalance_interval = argc > 3 && !force_decomposition ? atoi(argv[3]) : 0,
+        grid_side = 0;
+    // energy and momentum are written to argv[5] every diagnostics_interval steps
+    int diagnostics_interval = argc > 5 ? atoi(argv[4]) : 0;
+    if (force_decomposition) {
+        grid_side = (int) (sqrt((double) world_size) + 0.5);
+        if (grid_side * grid_side != world_size) {
+            if (p_rank == MASTER_RANK)
+                fprintf(stderr, "Warning: 2d needs a square number of processes, using 1d\n");
+            grid_side = 0;
+        }
+    }
+
     if (p_rank == MASTER_RANK)
-        master_process(mpi_body, world_size, argv[1], argv[2]);
+        master_process(
+            mpi_body, mpi_particle, world_size, argv[1], argv[2],
+            rebalance_interval, grid_side, diagnostics_interval, argc > 5 ? argv[5] : NULL
+        );
     else
-        slave_process(p_rank, world_size, mpi_body);
+        slave_process(
+            p_rank, world_size, mpi_body, mpi_particle, argv[1], argv[2],
+            rebalance_interval, grid_side, diagnostics_interval
+        );
 
     // freeing types
     MPI_Type_free(&mpi_vector3);
     MPI_Type_free(&mpi_body);
+    MPI_Type_free(&mpi_particle_struct);
+    MPI_Type_free(&mpi_particle);
 
     MPI_Finalize();
 
     return 0;
-}
\ No newline at end of file
+}
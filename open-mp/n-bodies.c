@@ -1,4 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <math.h>
 #include <omp.h>
 
@@ -8,21 +15,6 @@ typedef struct Vector3 {
     double z;
 } Vector3;
 
-Vector3 read_vector(FILE *stream)
-{
-    Vector3 result;
-    fscanf(
-        stream, "%lf %lf %lf",
-        &(result.x), &(result.y), &(result.z)
-    );
-    return result;
-}
-
-void write_vector(FILE *stream, Vector3 v)
-{
-    fprintf(stream, "(%lf, %lf, %lf)", v.x, v.y, v.z);
-}
-
 Vector3 plus(Vector3 v1, Vector3 v2)
 {
     Vector3 sum = { v1.x + v2.x, v1.y + v2.y, v1.z + v2.z };
@@ -68,21 +60,287 @@ typedef struct Body {
     double mass;
 } Body;
 
-Body read_body(FILE *stream)
+char *map_file(char *file_name, size_t *size)
 {
-    double mass;
-    fscanf(stream, "%lf", &mass);
-    Body result = { read_vector(stream), read_vector(stream), mass };
-    return result;
+    int fd = open(file_name, O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) < 0 || file_stat.st_size == 0) {
+        fprintf(stderr, "Error: Could not open %s\n", file_name);
+        exit(EXIT_FAILURE);
+    }
+    *size = file_stat.st_size;
+    char *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Error: Could not map %s\n", file_name);
+        exit(EXIT_FAILURE);
+    }
+    return data;
+}
+
+int is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// finds the next whitespace-separated token, returns its length or 0 at the end
+size_t next_token(const char **cursor, const char *end)
+{
+    while (*cursor < end && is_space(**cursor))
+        ++(*cursor);
+    size_t length = 0;
+    while (*cursor + length < end && !is_space((*cursor)[length]))
+        ++length;
+    return length;
+}
+
+/*
+ * Locale-independent parser for plain decimal numbers.
+ * Mantissas below 2^53 with |exponent| <= 22 are exact doubles, so one
+ * multiplication or division is correctly rounded and gives the same bits as strtod.
+ * Everything else is handed to strtod.
+ */
+double parse_double(const char *token, size_t length)
+{
+    static const double powers_of_ten[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char *p = token, *end = token + length;
+
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    unsigned long long mantissa = 0ull;
+    int significant_digits = 0, exponent = 0, digits = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+        mantissa = mantissa * 10 + (*p - '0');
+        significant_digits += mantissa != 0ull;
+    }
+    if (p < end && *p == '.')
+        for (++p; p < end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+            mantissa = mantissa * 10 + (*p - '0');
+            significant_digits += mantissa != 0ull;
+            --exponent;
+        }
+    if (digits > 0 && p < end && (*p == 'e' || *p == 'E')) {
+        const char *exponent_begin = ++p;
+        int exponent_negative = 0, exponent_value = 0;
+        if (p < end && (*p == '-' || *p == '+'))
+            exponent_negative = *p++ == '-';
+        for (; p < end && *p >= '0' && *p <= '9' && exponent_value < 10000; ++p)
+            exponent_value = exponent_value * 10 + (*p - '0');
+        if (p == exponent_begin)
+            digits = 0;
+        exponent += exponent_negative ? -exponent_value : exponent_value;
+    }
+
+    if (
+        p == end && digits > 0 && significant_digits <= 19
+        && mantissa <= (1ull << 53) && exponent >= -22 && exponent <= 22
+    ) {
+        double value = exponent < 0 ?
+            (double) mantissa / powers_of_ten[-exponent] :
+            (double) mantissa * powers_of_ten[exponent];
+        return negative ? -value : value;
+    }
+
+    char buffer[length + 1];
+    memcpy(buffer, token, length);
+    buffer[length] = '\0';
+    return strtod(buffer, NULL);
+}
+
+// G r dt n steps, returns the position after the header
+const char *parse_header(
+    const char *data, const char *end,
+    double *gravitation_const, double *body_radius, double *model_delta_t,
+    int *bodies_count, int *simulation_steps
+)
+{
+    double *doubles[] = { gravitation_const, body_radius, model_delta_t };
+    int *ints[] = { bodies_count, simulation_steps };
+    for (int k = 0; k < 5; ++k) {
+        size_t length = next_token(&data, end);
+        double value = parse_double(data, length);
+        if (k < 3)
+            *doubles[k] = value;
+        else
+            *ints[k - 3] = (int) value;
+        data += length;
+    }
+    return data;
+}
+
+void set_field(Body *body, int field, double value)
+{
+    switch (field) {
+        case 0: body->mass = value; break;
+        case 1: body->position.x = value; break;
+        case 2: body->position.y = value; break;
+        case 3: body->position.z = value; break;
+        case 4: body->velocity.x = value; break;
+        case 5: body->velocity.y = value; break;
+        case 6: body->velocity.z = value; break;
+    }
+}
+
+/*
+ * The text is cut into one chunk per thread at line boundaries. Every thread
+ * counts the numbers in its chunk, the prefix sums tell which body and field
+ * the first number of each chunk belongs to, then chunks are parsed independently.
+ */
+void parse_bodies(const char *begin, const char *end, int bodies_count, Body *bodies)
+{
+    const int fields_count = 7;
+    int max_threads = omp_get_max_threads();
+    const char *chunks[max_threads + 1];
+    long long numbers_before[max_threads + 1];
+
+    #pragma omp parallel shared(chunks, numbers_before, bodies)
+    {
+        int threads = omp_get_num_threads(),
+            thread = omp_get_thread_num();
+
+        #pragma omp single
+        {
+            chunks[0] = begin;
+            chunks[threads] = end;
+            for (int t = 1; t < threads; ++t) {
+                const char *p = begin + (end - begin) * t / threads;
+                if (p < chunks[t - 1])
+                    p = chunks[t - 1];
+                while (p < end && *p != '\n')
+                    ++p;
+                chunks[t] = p < end ? p + 1 : end;
+            }
+        }
+
+        long long numbers = 0;
+        const char *cursor = chunks[thread];
+        size_t length;
+        while ((length = next_token(&cursor, chunks[thread + 1])) > 0) {
+            ++numbers;
+            cursor += length;
+        }
+        numbers_before[thread + 1] = numbers;
+
+        #pragma omp barrier
+        #pragma omp single
+        {
+            numbers_before[0] = 0;
+            for (int t = 1; t <= threads; ++t)
+                numbers_before[t] += numbers_before[t - 1];
+        }
+
+        long long number = numbers_before[thread];
+        cursor = chunks[thread];
+        while ((length = next_token(&cursor, chunks[thread + 1])) > 0) {
+            if (number / fields_count < bodies_count)
+                set_field(bodies + number / fields_count, number % fields_count, parse_double(cursor, length));
+            ++number;
+            cursor += length;
+        }
+    }
 }
 
-void write_body(FILE *stream, Body body)
+// same text as fprintf of every body followed by a newline
+int render_body(char *buffer, size_t size, Body body)
 {
-    fprintf(stream, "body {\n\t'mass': %lf\n\t'position': ", body.mass);
-    write_vector(stream, body.position);
-    fprintf(stream, "\n\t'velocity': ");
-    write_vector(stream, body.velocity);
-    fprintf(stream, "\n}");
+    return snprintf(
+        buffer, size,
+        "body {\n\t'mass': %lf\n\t'position': (%lf, %lf, %lf)\n\t'velocity': (%lf, %lf, %lf)\n}\n",
+        body.mass,
+        body.position.x, body.position.y, body.position.z,
+        body.velocity.x, body.velocity.y, body.velocity.z
+    );
+}
+
+/*
+ * Every thread renders its range of bodies, the buffers are joined and written at once.
+ * Allocation failures inside the parallel region are only recorded, the program exits after it.
+ */
+void write_bodies(char *file_name, int bodies_count, Body *bodies)
+{
+    int max_threads = omp_get_max_threads(),
+        failed = 0;
+    size_t offsets[max_threads + 1],
+        total = 0;
+    char *output = NULL;
+
+    #pragma omp parallel shared(offsets, total, output, bodies, failed)
+    {
+        int threads = omp_get_num_threads(),
+            thread = omp_get_thread_num(),
+            first = (int) ((long long) bodies_count * thread / threads),
+            last = (int) ((long long) bodies_count * (thread + 1) / threads);
+
+        size_t capacity = (size_t) (last - first) * 160 + 1,
+            length = 0;
+        char *buffer = malloc(capacity);
+        for (int i = first; buffer && i < last; ++i) {
+            int written = render_body(buffer + length, capacity - length, bodies[i]);
+            while (buffer && (size_t) written >= capacity - length) {
+                capacity *= 2;
+                char *grown = realloc(buffer, capacity);
+                if (!grown) {
+                    free(buffer);
+                    buffer = NULL;
+                    break;
+                }
+                buffer = grown;
+                written = render_body(buffer + length, capacity - length, bodies[i]);
+            }
+            length += written;
+        }
+        if (!buffer) {
+            #pragma omp atomic write
+            failed = 1;
+            length = 0;
+        }
+        offsets[thread + 1] = length;
+
+        #pragma omp barrier
+        #pragma omp single
+        {
+            offsets[0] = 0;
+            for (int t = 1; t <= threads; ++t)
+                offsets[t] += offsets[t - 1];
+            total = offsets[threads];
+            output = failed ? NULL : malloc(total + 1);
+        }
+
+        if (output)
+            memcpy(output + offsets[thread], buffer, length);
+        free(buffer);
+    }
+
+    if (!output) {
+        fprintf(stderr, "Error: Could not allocate memory for %s\n", file_name);
+        exit(EXIT_FAILURE);
+    }
+
+    int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Could not open %s\n", file_name);
+        exit(EXIT_FAILURE);
+    }
+    size_t written = 0;
+    while (written < total) {
+        ssize_t result = write(fd, output + written, total - written);
+        if (result <= 0) {
+            fprintf(stderr, "Error: Could not write %s\n", file_name);
+            exit(EXIT_FAILURE);
+        }
+        written += result;
+    }
+    if (close(fd) < 0) {
+        fprintf(stderr, "Error: Could not write %s\n", file_name);
+        exit(EXIT_FAILURE);
+    }
+
+    free(output);
 }
 
 // induced by body_2 on body_1
@@ -96,25 +354,98 @@ Vector3 induced_acceleration(
     return multiply(body_2.mass, density);
 }
 
-void calculate_accelerations(
+/*
+ * Potential energy of two unit masses, consistent with gravity_density:
+ * -G / d outside of body_radius and the integral of the repulsion inside.
+ */
+double pair_potential(double gravitation_const, double body_radius, double distance)
+{
+    if (distance > body_radius)
+        return -gravitation_const / distance;
+    return gravitation_const / (2.0 * distance * distance)
+        - gravitation_const / body_radius
+        - gravitation_const / (2.0 * body_radius * body_radius);
+}
+
+// induced_acceleration that also gives the potential energy of the pair, the distance is computed once
+Vector3 induced_acceleration_potential(
     double gravitation_const, double body_radius,
-    int bodies_count, Body *bodies, Vector3 *accelerations
+    Body body_1, Body body_2, double *energy
 )
 {
-    #pragma omp parallel shared(bodies, accelerations)
-    {
-        #pragma omp for collapse(2)
-        for (int i = 0; i < bodies_count; ++i)
-            for (int j = 0; j < bodies_count; ++j)
+    Vector3 delta_r = minus(body_2.position, body_1.position);
+    double distance = absolute(delta_r);
+    double denominator = distance > body_radius ? pow(distance, 2.0) : -pow(distance, 3.0);
+    double abs_density = gravitation_const / denominator;
+    Vector3 density = {
+        abs_density * delta_r.x / distance,
+        abs_density * delta_r.y / distance,
+        abs_density * delta_r.z / distance
+    };
+    *energy = body_1.mass * body_2.mass * pair_potential(gravitation_const, body_radius, distance);
+    return multiply(body_2.mass, density);
+}
+
+#define TILE_SIZE 64 // bodies of a column tile stay in L1 while a thread walks its rows
+
+/*
+ * Rows from row_begin to row_end of the acceleration matrix, columns go in tiles
+ * of TILE_SIZE bodies. Returns the sum of the pair energies if with_potential.
+ */
+double calculate_rows(
+    double gravitation_const, double body_radius,
+    int bodies_count, Body *bodies, Vector3 *accelerations,
+    int row_begin, int row_end, int with_potential
+)
+{
+    double pair_energy = 0.0;
+    for (int tile = 0; tile < bodies_count; tile += TILE_SIZE) {
+        int tile_end = tile + TILE_SIZE < bodies_count ? tile + TILE_SIZE : bodies_count;
+        for (int i = row_begin; i < row_end; ++i)
+            for (int j = tile; j < tile_end; ++j)
                 if (i == j)
                     accelerations[i * bodies_count + j].x =
                         accelerations[i * bodies_count + j].y = 
                         accelerations[i * bodies_count + j].z = 0.0;
-                else
+                else if (!with_potential)
                     accelerations[i * bodies_count + j] = induced_acceleration(
                         gravitation_const, body_radius, bodies[i], bodies[j]
                     );
+                else {
+                    double energy;
+                    accelerations[i * bodies_count + j] = induced_acceleration_potential(
+                        gravitation_const, body_radius, bodies[i], bodies[j], &energy
+                    );
+                    pair_energy += energy;
+                }
     }
+    return pair_energy;
+}
+
+/*
+ * Every thread takes the same rows of the matrix as in first_touch.
+ * Potential energy of the system is accumulated in the same loop if potential is not NULL.
+ */
+void calculate_accelerations(
+    double gravitation_const, double body_radius,
+    int bodies_count, Body *bodies, Vector3 *accelerations, double *potential
+)
+{
+    double pair_energy = 0.0;
+    #pragma omp parallel shared(bodies, accelerations) reduction(+: pair_energy)
+    {
+        int threads = omp_get_num_threads(),
+            thread = omp_get_thread_num();
+        pair_energy += calculate_rows(
+            gravitation_const, body_radius, bodies_count, bodies, accelerations,
+            (long long) bodies_count * thread / threads,
+            (long long) bodies_count * (thread + 1) / threads,
+            potential != NULL
+        );
+    }
+    // every pair is visited twice
+    if (potential != NULL)
+        *potential = pair_energy / 2.0;
 }
 
 void accelerate(
@@ -123,7 +454,7 @@ void accelerate(
 {
     #pragma omp parallel shared(bodies, accelerations)
     {
-        #pragma omp for
+        #pragma omp for schedule(static)
         for (int i = 0; i < bodies_count; ++i) {
             for (int j = 0; j < bodies_count; ++j) {
                 bodies[i].velocity = plus(
@@ -140,7 +471,7 @@ void move(
 {
     #pragma omp parallel shared(bodies)
     {
-        #pragma omp for
+        #pragma omp for schedule(static)
         for (int i = 0; i < bodies_count; ++i)
             bodies[i].position = plus(
                 bodies[i].position,
@@ -149,30 +480,408 @@ void move(
     }
 }
 
+typedef struct Diagnostics {
+    double kinetic;
+    double potential;
+    Vector3 momentum;
+    Vector3 angular_momentum; // about the origin
+} Diagnostics;
+
+// everything except the potential energy, which comes from calculate_accelerations
+void diagnose(int bodies_count, Body *bodies, Diagnostics *diagnostics)
+{
+    double kinetic = 0.0, px = 0.0, py = 0.0, pz = 0.0, lx = 0.0, ly = 0.0, lz = 0.0;
+    #pragma omp parallel for schedule(static) reduction(+: kinetic, px, py, pz, lx, ly, lz)
+    for (int i = 0; i < bodies_count; ++i) {
+        Vector3 r = bodies[i].position,
+            p = multiply(bodies[i].mass, bodies[i].velocity);
+        kinetic += (p.x * bodies[i].velocity.x + p.y * bodies[i].velocity.y + p.z * bodies[i].velocity.z) / 2.0;
+        px += p.x;
+        py += p.y;
+        pz += p.z;
+        lx += r.y * p.z - r.z * p.y;
+        ly += r.z * p.x - r.x * p.z;
+        lz += r.x * p.y - r.y * p.x;
+    }
+    diagnostics->kinetic = kinetic;
+    diagnostics->momentum.x = px;
+    diagnostics->momentum.y = py;
+    diagnostics->momentum.z = pz;
+    diagnostics->angular_momentum.x = lx;
+    diagnostics->angular_momentum.y = ly;
+    diagnostics->angular_momentum.z = lz;
+}
+
+// one line per record, drift is relative to the energy of step 0
+void write_diagnostics(FILE *log_file, int step, Diagnostics *diagnostics, double initial_energy)
+{
+    double energy = diagnostics->kinetic + diagnostics->potential,
+        drift = initial_energy != 0.0 ? (energy - initial_energy) / fabs(initial_energy) : energy;
+    fprintf(
+        log_file, "%d %.9e %.9e %.9e %.3e %.9e %.9e %.9e %.9e %.9e %.9e\n",
+        step, diagnostics->kinetic, diagnostics->potential, energy, drift,
+        diagnostics->momentum.x, diagnostics->momentum.y, diagnostics->momentum.z,
+        diagnostics->angular_momentum.x, diagnostics->angular_momentum.y, diagnostics->angular_momentum.z
+    );
+    fflush(log_file);
+}
+
+#define ARENA_ALIGNMENT 64
+#define HUGE_PAGE_SIZE (2ul << 20)
+// flags of get_mempolicy, see numaif.h
+#define MPOL_F_NODE (1 << 0)
+#define MPOL_F_ADDR (1 << 1)
+
+typedef enum HugePages {
+    HUGE_PAGES_OFF,
+    HUGE_PAGES_TRANSPARENT,
+    HUGE_PAGES_EXPLICIT
+} HugePages;
+
+const char *huge_pages_name(HugePages huge_pages)
+{
+    switch (huge_pages) {
+        case HUGE_PAGES_TRANSPARENT:
+            return "transparent huge pages";
+        case HUGE_PAGES_EXPLICIT:
+            return "explicit huge pages";
+        default:
+            return "regular pages";
+    }
+}
+
+// N_BODIES_HUGE_PAGES=thp or N_BODIES_HUGE_PAGES=explicit
+HugePages huge_pages_from_env(void)
+{
+    char *value = getenv("N_BODIES_HUGE_PAGES");
+    if (value && strcmp(value, "thp") == 0)
+        return HUGE_PAGES_TRANSPARENT;
+    if (value && strcmp(value, "explicit") == 0)
+        return HUGE_PAGES_EXPLICIT;
+    return HUGE_PAGES_OFF;
+}
+
+/*
+ * One anonymous mapping for all arrays of a simulation. Nothing is touched here,
+ * so every page lands on the NUMA node of the thread that writes it first.
+ */
+typedef struct Arena {
+    char *mapping;
+    size_t mapping_size;
+    char *memory;
+    size_t capacity;
+    size_t used;
+    size_t page_size;
+    HugePages huge_pages;
+} Arena;
+
+size_t arena_aligned(size_t size)
+{
+    return (size + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+}
+
+void arena_create(Arena *arena, size_t capacity, HugePages huge_pages)
+{
+    arena->page_size = sysconf(_SC_PAGESIZE);
+    arena->huge_pages = huge_pages;
+    arena->capacity = capacity;
+    arena->used = 0;
+    arena->mapping = MAP_FAILED;
+
+    if (huge_pages == HUGE_PAGES_EXPLICIT) {
+        arena->mapping_size = (capacity + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        arena->mapping = mmap(
+            NULL, arena->mapping_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0
+        );
+        if (arena->mapping != MAP_FAILED) {
+            arena->memory = arena->mapping;
+            arena->page_size = HUGE_PAGE_SIZE;
+        } else {
+            arena->huge_pages = HUGE_PAGES_TRANSPARENT; // no reserved huge pages
+        }
+    }
+
+    if (arena->mapping == MAP_FAILED) {
+        // one extra huge page to align the start for transparent huge pages
+        arena->mapping_size = capacity + HUGE_PAGE_SIZE;
+        arena->mapping = mmap(
+            NULL, arena->mapping_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+        );
+        if (arena->mapping == MAP_FAILED) {
+            fprintf(stderr, "Error: Could not map %zu bytes\n", arena->mapping_size);
+            exit(EXIT_FAILURE);
+        }
+        arena->memory = (char *) (((size_t) arena->mapping + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+
+        if (arena->huge_pages == HUGE_PAGES_TRANSPARENT) {
+            if (madvise(arena->memory, capacity, MADV_HUGEPAGE) == 0)
+                arena->page_size = HUGE_PAGE_SIZE;
+            else
+                arena->huge_pages = HUGE_PAGES_OFF;
+        }
+    }
+}
+
+void *arena_alloc(Arena *arena, size_t size)
+{
+    size = arena_aligned(size);
+    if (arena->used + size > arena->capacity) {
+        fprintf(stderr, "Error: Arena of %zu bytes is exhausted\n", arena->capacity);
+        exit(EXIT_FAILURE);
+    }
+    void *result = arena->memory + arena->used;
+    arena->used += size;
+    return result;
+}
+
+void arena_destroy(Arena *arena)
+{
+    munmap(arena->mapping, arena->mapping_size);
+}
+
+// -1 if the page is not mapped yet or the kernel has no NUMA support
+int numa_node_of(void *address)
+{
+    int node = -1;
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0ul, address, MPOL_F_NODE | MPOL_F_ADDR) != 0)
+        return -1;
+    return node;
+}
+
+void report_arena(Arena *arena, void *first, void *last)
+{
+    fprintf(
+        stderr, "Arena: %zu bytes, page size %zu (%s), NUMA nodes of the first and the last blocks: %d, %d\n",
+        arena->capacity, arena->page_size, huge_pages_name(arena->huge_pages),
+        numa_node_of(first), numa_node_of(last)
+    );
+}
+
+// pages of every array are touched by the threads that own them in the step loop
+void first_touch(int bodies_count, Body *bodies, int *order, Vector3 *accelerations)
+{
+    #pragma omp parallel shared(bodies, order, accelerations)
+    {
+        #pragma omp for schedule(static)
+        for (int i = 0; i < bodies_count; ++i) {
+            memset(bodies + i, 0, sizeof(Body));
+            order[i] = i;
+        }
+
+        // the same rows as in calculate_accelerations
+        int threads = omp_get_num_threads(),
+            thread = omp_get_thread_num(),
+            row_begin = (long long) bodies_count * thread / threads,
+            row_end = (long long) bodies_count * (thread + 1) / threads;
+        for (int i = row_begin; i < row_end; ++i)
+            memset(accelerations + (size_t) i * bodies_count, 0, bodies_count * sizeof(Vector3));
+    }
+}
+
+unsigned long long spread_bits(unsigned long long v)
+{
+    v &= 0x1fffffull;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+// interleaves 21 bits of every coordinate, normalized to the bounding box
+unsigned long long morton_key(Vector3 position, Vector3 lower, Vector3 upper)
+{
+    const double scale = (double) 0x1fffff;
+    double coords[] = { position.x, position.y, position.z },
+        lowers[] = { lower.x, lower.y, lower.z },
+        uppers[] = { upper.x, upper.y, upper.z };
+    unsigned long long key = 0ull;
+    for (int d = 0; d < 3; ++d) {
+        double extent = uppers[d] - lowers[d],
+            normalized = extent > 0.0 ? (coords[d] - lowers[d]) / extent : 0.0;
+        key |= spread_bits((unsigned long long) (normalized * scale)) << d;
+    }
+    return key;
+}
+
+/*
+ * LSD radix sort by bytes, permutation is moved along with the keys.
+ * Every thread counts digits of its own chunk, then chunks are scattered
+ * to offsets ordered by (digit, thread), which keeps the sort stable.
+ */
+void radix_sort(Arena *arena, int count, unsigned long long *keys, int *permutation)
+{
+    size_t mark = arena->used;
+    unsigned long long *key_buff = arena_alloc(arena, count * sizeof(unsigned long long));
+    int *permutation_buff = arena_alloc(arena, count * sizeof(int));
+    int max_threads = omp_get_max_threads();
+    int offsets[max_threads][256];
+
+    #pragma omp parallel shared(keys, permutation, key_buff, permutation_buff, offsets)
+    {
+        int threads = omp_get_num_threads(),
+            thread = omp_get_thread_num(),
+            begin = (int) ((long long) count * thread / threads),
+            end = (int) ((long long) count * (thread + 1) / threads);
+        unsigned long long *src_keys = keys, *dst_keys = key_buff, *swap_keys;
+        int *src_permutation = permutation, *dst_permutation = permutation_buff, *swap_permutation;
+
+        for (int shift = 0; shift < 64; shift += 8) {
+            for (int d = 0; d < 256; ++d)
+                offsets[thread][d] = 0;
+            for (int i = begin; i < end; ++i)
+                ++offsets[thread][(src_keys[i] >> shift) & 0xff];
+
+            #pragma omp barrier
+            #pragma omp single
+            {
+                int sum = 0;
+                for (int d = 0; d < 256; ++d)
+                    for (int t = 0; t < threads; ++t) {
+                        int digit_count = offsets[t][d];
+                        offsets[t][d] = sum;
+                        sum += digit_count;
+                    }
+            }
+
+            for (int i = begin; i < end; ++i) {
+                int position = offsets[thread][(src_keys[i] >> shift) & 0xff]++;
+                dst_keys[position] = src_keys[i];
+                dst_permutation[position] = src_permutation[i];
+            }
+            #pragma omp barrier
+
+            swap_keys = src_keys; src_keys = dst_keys; dst_keys = swap_keys;
+            swap_permutation = src_permutation; src_permutation = dst_permutation; dst_permutation = swap_permutation;
+        }
+    }
+    // even number of passes, so the result is back in keys and permutation
+    arena->used = mark;
+}
+
+// arena space taken by reorder_bodies for the time of the call
+size_t reorder_scratch_size(int bodies_count)
+{
+    return 2 * arena_aligned(bodies_count * sizeof(unsigned long long))
+        + 3 * arena_aligned(bodies_count * sizeof(int))
+        + arena_aligned(bodies_count * sizeof(Body));
+}
+
+// sorts bodies along the Morton curve, order[k] keeps the input position of bodies[k]
+void reorder_bodies(Arena *arena, int bodies_count, Body *bodies, int *order)
+{
+    size_t mark = arena->used;
+
+    double min_x = INFINITY, min_y = INFINITY, min_z = INFINITY,
+        max_x = -INFINITY, max_y = -INFINITY, max_z = -INFINITY;
+    #pragma omp parallel for reduction(min: min_x, min_y, min_z) reduction(max: max_x, max_y, max_z)
+    for (int i = 0; i < bodies_count; ++i) {
+        Vector3 p = bodies[i].position;
+        min_x = fmin(min_x, p.x); max_x = fmax(max_x, p.x);
+        min_y = fmin(min_y, p.y); max_y = fmax(max_y, p.y);
+        min_z = fmin(min_z, p.z); max_z = fmax(max_z, p.z);
+    }
+    Vector3 lower = { min_x, min_y, min_z },
+        upper = { max_x, max_y, max_z };
+
+    unsigned long long *keys = arena_alloc(arena, bodies_count * sizeof(unsigned long long));
+    int *permutation = arena_alloc(arena, bodies_count * sizeof(int));
+    #pragma omp parallel for
+    for (int i = 0; i < bodies_count; ++i) {
+        keys[i] = morton_key(bodies[i].position, lower, upper);
+        permutation[i] = i;
+    }
+    radix_sort(arena, bodies_count, keys, permutation);
+
+    Body *body_buff = arena_alloc(arena, bodies_count * sizeof(Body));
+    int *order_buff = arena_alloc(arena, bodies_count * sizeof(int));
+    #pragma omp parallel shared(bodies, order, body_buff, order_buff)
+    {
+        #pragma omp for
+        for (int i = 0; i < bodies_count; ++i) {
+            body_buff[i] = bodies[permutation[i]];
+            order_buff[i] = order[permutation[i]];
+        }
+        #pragma omp for
+        for (int i = 0; i < bodies_count; ++i) {
+            bodies[i] = body_buff[i];
+            order[i] = order_buff[i];
+        }
+    }
+
+    arena->used = mark;
+}
+
 int main(int argc, char **argv)
 {
     double gravitation_const, body_radius, model_delta_t;
     int bodies_count, simulation_steps;
+    // bodies are sorted along the Morton curve every reorder_interval steps, 0 disables it
+    int reorder_interval = argc > 3 ? atoi(argv[3]) : 0;
+    // energy and momentum are written to log_file every diagnostics_interval steps
+    int diagnostics_interval = argc > 5 ? atoi(argv[4]) : 0;
+    FILE *log_file = NULL;
+    if (diagnostics_interval > 0) {
+        log_file = fopen(argv[5], "w");
+        if (!log_file) {
+            fprintf(stderr, "Error: Could not open %s\n", argv[5]);
+            return 1;
+        }
+        fprintf(log_file, "# step kinetic potential total drift px py pz lx ly lz\n");
+    }
     
-    FILE *task_file = fopen(argv[1], "r");
-    fscanf(
-        task_file, "%lf %lf %lf %d %d",
+    size_t task_size;
+    char *task_data = map_file(argv[1], &task_size);
+    const char *bodies_text = parse_header(
+        task_data, task_data + task_size,
         &gravitation_const, &body_radius, &model_delta_t,
         &bodies_count, &simulation_steps
     );
     
-    Body bodies[bodies_count];
-    for (int i = 0; i < bodies_count; ++i)
-        bodies[i] = read_body(task_file);
-            
-    fclose(task_file);
+    Arena arena;
+    arena_create(
+        &arena,
+        2 * arena_aligned(bodies_count * sizeof(Body))
+            + arena_aligned(bodies_count * sizeof(int))
+            + arena_aligned((size_t) bodies_count * bodies_count * sizeof(Vector3))
+            + reorder_scratch_size(bodies_count),
+        huge_pages_from_env()
+    );
+    Body *bodies = arena_alloc(&arena, bodies_count * sizeof(Body)),
+        *ordered_bodies = arena_alloc(&arena, bodies_count * sizeof(Body));
+    int *order = arena_alloc(&arena, bodies_count * sizeof(int));
+    Vector3 *accelerations = arena_alloc(&arena, (size_t) bodies_count * bodies_count * sizeof(Vector3));
+
+    first_touch(bodies_count, bodies, order, accelerations);
+    report_arena(&arena, accelerations, accelerations + (size_t) bodies_count * bodies_count - 1);
+
+    parse_bodies(bodies_text, task_data + task_size, bodies_count, bodies);
+    munmap(task_data, task_size);
 
     double begin, end;
     begin = omp_get_wtime();
     
-    Vector3 accelerations[bodies_count * bodies_count];
+    double initial_energy = 0.0;
     for (int i = 0; i < simulation_steps; ++i) {
-        calculate_accelerations(gravitation_const, body_radius, bodies_count, bodies, accelerations);
+        if (reorder_interval > 0 && i % reorder_interval == 0)
+            reorder_bodies(&arena, bodies_count, bodies, order);
+        Diagnostics diagnostics;
+        int diagnosed = log_file != NULL && i % diagnostics_interval == 0;
+        calculate_accelerations(
+            gravitation_const, body_radius, bodies_count, bodies, accelerations,
+            diagnosed ? &diagnostics.potential : NULL
+        );
+        if (diagnosed) {
+            // accelerate adds the accelerations without dt, so the energy conserved by the step is K + U / dt
+            diagnostics.potential /= model_delta_t;
+            diagnose(bodies_count, bodies, &diagnostics);
+            if (i == 0)
+                initial_energy = diagnostics.kinetic + diagnostics.potential;
+            write_diagnostics(log_file, i, &diagnostics, initial_energy);
+        }
         accelerate(bodies_count, bodies, accelerations);
         move(model_delta_t, bodies_count, bodies);
     }
@@ -180,12 +889,15 @@ int main(int argc, char **argv)
     end = omp_get_wtime();
     printf("Time taken: %lf sec\n", end - begin);
 
-    FILE *solution_file = fopen(argv[2], "w");
-    for (int i = 0; i < bodies_count; ++i) {
-        write_body(solution_file, bodies[i]);
-        fprintf(solution_file, "\n");
-    }
-    fclose(solution_file);
+    // restore the input order
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < bodies_count; ++i)
+        ordered_bodies[order[i]] = bodies[i];
+
+    write_bodies(argv[2], bodies_count, ordered_bodies);
+    arena_destroy(&arena);
+    if (log_file)
+        fclose(log_file);
     
     return 0;
 }
\ No newline at end of file
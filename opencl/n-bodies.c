@@ -1,6 +1,12 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <CL/cl.h>
 #include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 typedef struct __attribute__ ((packed)) Vector3 {
     float x;
@@ -14,6 +20,19 @@ typedef struct __attribute__ ((packed)) Body {
     float mass;
 } Body;
 
+#define MAX_DEVICES 64
+
+const char *device_type_name(cl_device_type device_type)
+{
+    if (device_type & CL_DEVICE_TYPE_GPU)
+        return "gpu";
+    if (device_type & CL_DEVICE_TYPE_CPU)
+        return "cpu";
+    if (device_type & CL_DEVICE_TYPE_ACCELERATOR)
+        return "accelerator";
+    return "other";
+}
+
 cl_int get_device_id(cl_device_id *result)
 {
     cl_int status;
@@ -31,14 +50,74 @@ cl_int get_device_id(cl_device_id *result)
     if (status != CL_SUCCESS)
         return status;
 
-    status+= 1;
-    uint i = 0;
-    while ((status != CL_SUCCESS) || i < num_platforms) {
-        status = clGetDeviceIDs(Platform[i], CL_DEVICE_TYPE_DEFAULT, 1, result, NULL);
-        i += 1;
+    const char *choice = getenv("N_BODIES_DEVICE");
+    if (!choice) {
+        status = CL_DEVICE_NOT_FOUND;
+        uint i = 0;
+        while ((status != CL_SUCCESS) && i < num_platforms) {
+            status = clGetDeviceIDs(Platform[i], CL_DEVICE_TYPE_DEFAULT, 1, result, NULL);
+            i += 1;
+        }
+        return status;
+    }
+
+    // N_BODIES_DEVICE is an index from list_devices or cpu, gpu, accelerator for the first device of that type
+    cl_device_id devices[MAX_DEVICES];
+    cl_uint count = 0;
+    for (uint i = 0; i < num_platforms && count < MAX_DEVICES; ++i) {
+        cl_uint platform_count;
+        if (clGetDeviceIDs(Platform[i], CL_DEVICE_TYPE_ALL, MAX_DEVICES - count, devices + count, &platform_count) != CL_SUCCESS)
+            continue;
+        count += platform_count < MAX_DEVICES - count ? platform_count : MAX_DEVICES - count;
     }
 
-    return status;
+    char *end;
+    long index = strtol(choice, &end, 10);
+    for (cl_uint d = 0; d < count; ++d) {
+        cl_device_type device_type;
+        clGetDeviceInfo(devices[d], CL_DEVICE_TYPE, sizeof(device_type), &device_type, NULL);
+        if (
+            (*end == '\0' && end != choice && index == (long) d)
+            || strcmp(choice, device_type_name(device_type)) == 0
+        ) {
+            *result = devices[d];
+            return CL_SUCCESS;
+        }
+    }
+
+    return CL_DEVICE_NOT_FOUND;
+}
+
+// prints the devices of all platforms with the indices accepted by N_BODIES_DEVICE
+cl_int list_devices()
+{
+    cl_uint num_platforms;
+    cl_int status = clGetPlatformIDs(0, NULL, &num_platforms);
+    if (status != CL_SUCCESS || num_platforms == 0)
+        return status;
+
+    cl_platform_id Platform[num_platforms];
+    status = clGetPlatformIDs(num_platforms, Platform, NULL);
+    if (status != CL_SUCCESS)
+        return status;
+
+    cl_uint index = 0;
+    for (uint i = 0; i < num_platforms && index < MAX_DEVICES; ++i) {
+        cl_device_id devices[MAX_DEVICES];
+        cl_uint platform_count;
+        if (clGetDeviceIDs(Platform[i], CL_DEVICE_TYPE_ALL, MAX_DEVICES, devices, &platform_count) != CL_SUCCESS)
+            continue;
+        for (cl_uint d = 0; d < platform_count && d < MAX_DEVICES && index < MAX_DEVICES; ++d, ++index) {
+            cl_device_type device_type;
+            char name[256];
+            clGetDeviceInfo(devices[d], CL_DEVICE_TYPE, sizeof(device_type), &device_type, NULL);
+            clGetDeviceInfo(devices[d], CL_DEVICE_NAME, sizeof(name), name, NULL);
+            name[sizeof(name) - 1] = '\0';
+            printf("%u: %s %s\n", index, device_type_name(device_type), name);
+        }
+    }
+
+    return CL_SUCCESS;
 }
 
 char *getKernelSource(char *filename)
@@ -64,7 +143,10 @@ char *getKernelSource(char *filename)
     return source;
 }
 
-cl_int build_from_source(char *filename, cl_context context, cl_device_id device_id, cl_program *result)
+cl_int build_from_source(
+    char *filename, const char *options,
+    cl_context context, cl_device_id device_id, cl_program *result
+)
 {
     cl_int status;
     char *kernel_source = getKernelSource(filename);
@@ -74,7 +156,7 @@ cl_int build_from_source(char *filename, cl_context context, cl_device_id device
     if (status != CL_SUCCESS)
         return status;
 
-    status = clBuildProgram(*result, 0, NULL, NULL, NULL, NULL);
+    status = clBuildProgram(*result, 0, NULL, options, NULL, NULL);
 
     if (status != CL_SUCCESS) {
         size_t len;
@@ -228,8 +310,545 @@ void write_body(FILE *stream, Body body)
     fprintf(stream, "\n}");
 }
 
+void write_snapshot(FILE *stream, int step, int bodies_count, Body *bodies)
+{
+    fprintf(stream, "step %d\n", step);
+    for (int i = 0; i < bodies_count; ++i) {
+        write_body(stream, bodies[i]);
+        fprintf(stream, "\n");
+    }
+}
+
+#define ARENA_ALIGNMENT 64
+#define HUGE_PAGE_SIZE (2ul << 20)
+// flags of get_mempolicy, see numaif.h
+#define MPOL_F_NODE (1 << 0)
+#define MPOL_F_ADDR (1 << 1)
+
+typedef enum HugePages {
+    HUGE_PAGES_OFF,
+    HUGE_PAGES_TRANSPARENT,
+    HUGE_PAGES_EXPLICIT
+} HugePages;
+
+const char *huge_pages_name(HugePages huge_pages)
+{
+    switch (huge_pages) {
+        case HUGE_PAGES_TRANSPARENT:
+            return "transparent huge pages";
+        case HUGE_PAGES_EXPLICIT:
+            return "explicit huge pages";
+        default:
+            return "regular pages";
+    }
+}
+
+// N_BODIES_HUGE_PAGES=thp or N_BODIES_HUGE_PAGES=explicit
+HugePages huge_pages_from_env(void)
+{
+    char *value = getenv("N_BODIES_HUGE_PAGES");
+    if (value && strcmp(value, "thp") == 0)
+        return HUGE_PAGES_TRANSPARENT;
+    if (value && strcmp(value, "explicit") == 0)
+        return HUGE_PAGES_EXPLICIT;
+    return HUGE_PAGES_OFF;
+}
+
+// one anonymous mapping for all arrays of a simulation
+typedef struct Arena {
+    char *mapping;
+    size_t mapping_size;
+    char *memory;
+    size_t capacity;
+    size_t used;
+    size_t page_size;
+    HugePages huge_pages;
+} Arena;
+
+size_t arena_aligned(size_t size)
+{
+    return (size + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+}
+
+void arena_create(Arena *arena, size_t capacity, HugePages huge_pages)
+{
+    arena->page_size = sysconf(_SC_PAGESIZE);
+    arena->huge_pages = huge_pages;
+    arena->capacity = capacity;
+    arena->used = 0;
+    arena->mapping = MAP_FAILED;
+
+    if (huge_pages == HUGE_PAGES_EXPLICIT) {
+        arena->mapping_size = (capacity + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        arena->mapping = mmap(
+            NULL, arena->mapping_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0
+        );
+        if (arena->mapping != MAP_FAILED) {
+            arena->memory = arena->mapping;
+            arena->page_size = HUGE_PAGE_SIZE;
+        } else {
+            arena->huge_pages = HUGE_PAGES_TRANSPARENT; // no reserved huge pages
+        }
+    }
+
+    if (arena->mapping == MAP_FAILED) {
+        // one extra huge page to align the start for transparent huge pages
+        arena->mapping_size = capacity + HUGE_PAGE_SIZE;
+        arena->mapping = mmap(
+            NULL, arena->mapping_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+        );
+        if (arena->mapping == MAP_FAILED) {
+            fprintf(stderr, "Error: Could not map %zu bytes\n", arena->mapping_size);
+            exit(EXIT_FAILURE);
+        }
+        arena->memory = (char *) (((size_t) arena->mapping + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+
+        if (arena->huge_pages == HUGE_PAGES_TRANSPARENT) {
+            if (madvise(arena->memory, capacity, MADV_HUGEPAGE) == 0)
+                arena->page_size = HUGE_PAGE_SIZE;
+            else
+                arena->huge_pages = HUGE_PAGES_OFF;
+        }
+    }
+}
+
+void *arena_alloc(Arena *arena, size_t size)
+{
+    size = arena_aligned(size);
+    if (arena->used + size > arena->capacity) {
+        fprintf(stderr, "Error: Arena of %zu bytes is exhausted\n", arena->capacity);
+        exit(EXIT_FAILURE);
+    }
+    void *result = arena->memory + arena->used;
+    arena->used += size;
+    return result;
+}
+
+void arena_destroy(Arena *arena)
+{
+    munmap(arena->mapping, arena->mapping_size);
+}
+
+// -1 if the page is not mapped yet or the kernel has no NUMA support
+int numa_node_of(void *address)
+{
+    int node = -1;
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0ul, address, MPOL_F_NODE | MPOL_F_ADDR) != 0)
+        return -1;
+    return node;
+}
+
+void report_arena(Arena *arena, void *first, void *last)
+{
+    fprintf(
+        stderr, "Arena: %zu bytes, page size %zu (%s), NUMA nodes of the first and the last blocks: %d, %d\n",
+        arena->capacity, arena->page_size, huge_pages_name(arena->huge_pages),
+        numa_node_of(first), numa_node_of(last)
+    );
+}
+
+cl_int is_cpu_device(cl_device_id device_id, int *result)
+{
+    cl_device_type device_type;
+    cl_int status = clGetDeviceInfo(device_id, CL_DEVICE_TYPE, sizeof(device_type), &device_type, NULL);
+    *result = (status == CL_SUCCESS) && (device_type & CL_DEVICE_TYPE_CPU);
+    return status;
+}
+
+#define TUNING_FILE_NAME "n-bodies.tuning"
+#define TUNING_REPETITIONS 3
+
+// parameters of the step kernel, tile_size and unroll are passed as -D build options
+typedef struct Tuning {
+    int local_size;
+    int tile_size;
+    int unroll;
+} Tuning;
+
+void format_build_options(Tuning tuning, char *options)
+{
+    sprintf(options, "-D TILE_SIZE=%d -D UNROLL=%d", tuning.tile_size, tuning.unroll);
+}
+
+size_t round_up(size_t value, size_t multiple)
+{
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+// tuned parameters are shared by all counts in [2^k, 2^(k+1))
+int bodies_range_low(int bodies_count)
+{
+    int low = 1;
+    while (low * 2 <= bodies_count)
+        low *= 2;
+    return low;
+}
+
+cl_int get_device_name(cl_device_id device_id, char *name, size_t size)
+{
+    cl_int status = clGetDeviceInfo(device_id, CL_DEVICE_NAME, size, name, NULL);
+    name[size - 1] = '\0';
+    return status;
+}
+
+// every line of the file is "low high local_size tile_size unroll device name"
+int load_tuning(char *device_name, int bodies_count, Tuning *result)
+{
+    FILE *tuning_file = fopen(TUNING_FILE_NAME, "r");
+    if (!tuning_file)
+        return 0;
+
+    int low, high, found = 0;
+    Tuning tuning;
+    char name[256];
+    while (fscanf(
+        tuning_file, "%d %d %d %d %d %255[^\n]",
+        &low, &high, &tuning.local_size, &tuning.tile_size, &tuning.unroll, name
+    ) == 6)
+        if (low <= bodies_count && bodies_count <= high && strcmp(name, device_name) == 0) {
+            *result = tuning;
+            found = 1;
+        }
+
+    fclose(tuning_file);
+    return found;
+}
+
+void save_tuning(char *device_name, int bodies_count, Tuning tuning)
+{
+    FILE *tuning_file = fopen(TUNING_FILE_NAME, "a");
+    if (!tuning_file)
+        return;
+    int low = bodies_range_low(bodies_count);
+    fprintf(
+        tuning_file, "%d %d %d %d %d %s\n",
+        low, 2 * low - 1, tuning.local_size, tuning.tile_size, tuning.unroll, device_name
+    );
+    fclose(tuning_file);
+}
+
+// best of TUNING_REPETITIONS launches after one warm-up, measured with profiling events
+cl_int time_step_kernel(
+    cl_command_queue profiling_queue, cl_kernel step_kernel,
+    int bodies_count, size_t local_size, double *seconds
+)
+{
+    cl_int status = CL_SUCCESS;
+    size_t global_work_size[] = { round_up(bodies_count, local_size) },
+        local_work_size[] = { local_size };
+
+    *seconds = -1.0;
+    for (int repetition = 0; repetition <= TUNING_REPETITIONS; ++repetition) {
+        cl_event kernel_done;
+        status = clEnqueueNDRangeKernel(
+            profiling_queue, step_kernel, 1, NULL, global_work_size, local_work_size,
+            0u, NULL, &kernel_done
+        );
+        if (status != CL_SUCCESS)
+            return status;
+        clWaitForEvents(1, &kernel_done);
+
+        cl_ulong start, end;
+        status = clGetEventProfilingInfo(kernel_done, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+        status |= clGetEventProfilingInfo(kernel_done, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+        clReleaseEvent(kernel_done);
+        if (status != CL_SUCCESS)
+            return status;
+
+        double elapsed = (end - start) * 1e-9;
+        if (repetition > 0 && (*seconds < 0.0 || elapsed < *seconds))
+            *seconds = elapsed;
+    }
+
+    return status;
+}
+
+// sweeps local sizes, tile sizes and unroll factors of the step kernel on the given bodies
+cl_int autotune(
+    char *kernel_file_name, cl_context context, cl_device_id device_id,
+    cl_mem g_mem, cl_mem body_radius_mem, cl_mem bodies_count_mem, cl_mem model_dt_mem,
+    int bodies_count, Body *bodies, Tuning *result
+)
+{
+    const int local_sizes[] = { 16, 32, 64, 128, 256 },
+        tile_sizes[] = { 32, 64, 128, 256 },
+        unrolls[] = { 1, 2, 4 };
+
+    cl_int status;
+    size_t max_work_group_size;
+    cl_ulong local_mem_size;
+    status = clGetDeviceInfo(device_id, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_work_group_size), &max_work_group_size, NULL);
+    status |= clGetDeviceInfo(device_id, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem_size), &local_mem_size, NULL);
+    if (status != CL_SUCCESS)
+        return status;
+
+    cl_queue_properties properties[] = { CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0 };
+    cl_command_queue profiling_queue = clCreateCommandQueueWithProperties(context, device_id, properties, &status);
+    if (status != CL_SUCCESS)
+        return status;
+
+    cl_mem bodies_in_mem = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, bodies_count * sizeof(Body), bodies, &status),
+        bodies_out_mem = clCreateBuffer(context, CL_MEM_WRITE_ONLY, bodies_count * sizeof(Body), NULL, &status);
+
+    double best_seconds = -1.0;
+    for (size_t t = 0; t < sizeof(tile_sizes) / sizeof(int); ++t)
+        for (size_t u = 0; u < sizeof(unrolls) / sizeof(int); ++u) {
+            Tuning tuning = { 0, tile_sizes[t], unrolls[u] };
+            if (tuning.tile_size * sizeof(Body) > local_mem_size)
+                continue;
+
+            char options[64];
+            format_build_options(tuning, options);
+            cl_program program;
+            if (build_from_source(kernel_file_name, options, context, device_id, &program) != CL_SUCCESS)
+                continue;
+            cl_kernel step_kernel = clCreateKernel(program, "step", &status);
+
+            status |= clSetKernelArg(step_kernel, 0u, sizeof(cl_mem), &g_mem);
+            status |= clSetKernelArg(step_kernel, 1u, sizeof(cl_mem), &body_radius_mem);
+            status |= clSetKernelArg(step_kernel, 2u, sizeof(cl_mem), &bodies_count_mem);
+            status |= clSetKernelArg(step_kernel, 3u, sizeof(cl_mem), &model_dt_mem);
+            status |= clSetKernelArg(step_kernel, 4u, sizeof(cl_mem), &bodies_in_mem);
+            status |= clSetKernelArg(step_kernel, 5u, sizeof(cl_mem), &bodies_out_mem);
+
+            for (size_t l = 0; status == CL_SUCCESS && l < sizeof(local_sizes) / sizeof(int); ++l) {
+                if ((size_t) local_sizes[l] > max_work_group_size)
+                    break;
+                double seconds;
+                if (time_step_kernel(profiling_queue, step_kernel, bodies_count, local_sizes[l], &seconds) != CL_SUCCESS)
+                    continue;
+                if (best_seconds < 0.0 || seconds < best_seconds) {
+                    best_seconds = seconds;
+                    tuning.local_size = local_sizes[l];
+                    *result = tuning;
+                }
+            }
+
+            clReleaseKernel(step_kernel);
+            clReleaseProgram(program);
+            status = CL_SUCCESS;
+        }
+
+    clReleaseMemObject(bodies_in_mem);
+    clReleaseMemObject(bodies_out_mem);
+    clReleaseCommandQueue(profiling_queue);
+
+    return best_seconds < 0.0 ? CL_INVALID_WORK_GROUP_SIZE : CL_SUCCESS;
+}
+
+#define SNAPSHOT_SLOTS 4
+
+/*
+ * Snapshots are formatted on their own thread, so the enqueuing loop only waits
+ * when all SNAPSHOT_SLOTS host arrays are still queued for writing.
+ */
+typedef struct SnapshotWriter {
+    FILE *file;
+    int bodies_count;
+    Body *slots[SNAPSHOT_SLOTS];
+    cl_event reads[SNAPSHOT_SLOTS];
+    int steps[SNAPSHOT_SLOTS];
+    int queued; // snapshots handed to the writer
+    int written;
+    int finished; // no more snapshots will be queued
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} SnapshotWriter;
+
+void *write_snapshots(void *argument)
+{
+    SnapshotWriter *writer = argument;
+    pthread_mutex_lock(&writer->lock);
+    for (;;) {
+        while (writer->written == writer->queued && !writer->finished)
+            pthread_cond_wait(&writer->changed, &writer->lock);
+        if (writer->written == writer->queued)
+            break;
+        int slot = writer->written % SNAPSHOT_SLOTS;
+        pthread_mutex_unlock(&writer->lock);
+
+        clWaitForEvents(1, writer->reads + slot);
+        clReleaseEvent(writer->reads[slot]);
+        write_snapshot(writer->file, writer->steps[slot], writer->bodies_count, writer->slots[slot]);
+
+        pthread_mutex_lock(&writer->lock);
+        ++writer->written;
+        pthread_cond_broadcast(&writer->changed);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+// slot for the next snapshot, waits until the writer is done with it
+int acquire_slot(SnapshotWriter *writer)
+{
+    pthread_mutex_lock(&writer->lock);
+    while (writer->queued - writer->written == SNAPSHOT_SLOTS)
+        pthread_cond_wait(&writer->changed, &writer->lock);
+    int slot = writer->queued % SNAPSHOT_SLOTS;
+    pthread_mutex_unlock(&writer->lock);
+    return slot;
+}
+
+void queue_snapshot(SnapshotWriter *writer, int slot, int step, cl_event read)
+{
+    pthread_mutex_lock(&writer->lock);
+    writer->reads[slot] = read;
+    writer->steps[slot] = step;
+    ++writer->queued;
+    pthread_cond_broadcast(&writer->changed);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+/*
+ * One kernel launch per step. Step t reads bodies_mem[t % 2] and writes the other buffer,
+ * so the state after step t can be read back on the second queue while step t + 1 runs.
+ * Only step t + 2 overwrites that buffer, so it alone waits for the readback, never for
+ * the formatting of the snapshot. With snapshot_interval 0 the bodies are read back once
+ * after the last step.
+ */
+cl_int run_pipelined(
+    cl_context context, cl_device_id device_id, cl_program program,
+    cl_mem g_mem, cl_mem body_radius_mem, cl_mem bodies_count_mem, cl_mem model_dt_mem,
+    int bodies_count, int simulation_steps, Body *bodies,
+    size_t local_size, int snapshot_interval, FILE *snapshot_file
+)
+{
+    cl_int status, created;
+    cl_command_queue commands = clCreateCommandQueueWithProperties(context, device_id, NULL, &status),
+        readback = clCreateCommandQueueWithProperties(context, device_id, NULL, &created);
+    status |= created;
+    cl_kernel step_kernel = clCreateKernel(program, "step", &created);
+    status |= created;
+
+    // on CPU devices the buffers live in host memory and the readback is a plain copy
+    int cpu_device;
+    is_cpu_device(device_id, &cpu_device);
+
+    size_t bodies_size = bodies_count * sizeof(Body),
+        aligned_size = (bodies_size + 4095) / 4096 * 4096;
+    void *host_buffers[2] = { NULL, NULL };
+    cl_mem bodies_mem[2] = { NULL, NULL };
+    for (int b = 0; status == CL_SUCCESS && b < 2; ++b) {
+        if (cpu_device) {
+            host_buffers[b] = aligned_alloc(4096, aligned_size);
+            if (!host_buffers[b]) {
+                status = CL_OUT_OF_HOST_MEMORY;
+                break;
+            }
+            memcpy(host_buffers[b], bodies, bodies_size);
+            bodies_mem[b] = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, bodies_size, host_buffers[b], &created);
+        } else {
+            bodies_mem[b] = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, bodies_size, bodies, &created);
+        }
+        status |= created;
+    }
+
+    if (status == CL_SUCCESS) {
+        status |= clSetKernelArg(step_kernel, 0u, sizeof(cl_mem), &g_mem);
+        status |= clSetKernelArg(step_kernel, 1u, sizeof(cl_mem), &body_radius_mem);
+        status |= clSetKernelArg(step_kernel, 2u, sizeof(cl_mem), &bodies_count_mem);
+        status |= clSetKernelArg(step_kernel, 3u, sizeof(cl_mem), &model_dt_mem);
+    }
+
+    SnapshotWriter writer = { .file = snapshot_file, .bodies_count = bodies_count };
+    pthread_mutex_init(&writer.lock, NULL);
+    pthread_cond_init(&writer.changed, NULL);
+    pthread_t writer_thread;
+    int writing = status == CL_SUCCESS && snapshot_interval > 0;
+    if (writing) {
+        for (int slot = 0; slot < SNAPSHOT_SLOTS; ++slot)
+            if (!(writer.slots[slot] = malloc(bodies_size + 1)))
+                status = CL_OUT_OF_HOST_MEMORY;
+        writing = status == CL_SUCCESS && pthread_create(&writer_thread, NULL, write_snapshots, &writer) == 0;
+        if (!writing)
+            status |= CL_OUT_OF_HOST_MEMORY;
+    }
+
+    cl_event buffer_reads[2] = { NULL, NULL }, // readbacks still holding bodies_mem[b]
+        kernel_done;
+    size_t global_work_size[] = { round_up(bodies_count, local_size) },
+        local_work_size[] = { local_size };
+    for (int step = 0; status == CL_SUCCESS && step < simulation_steps; ++step) {
+        int in = step % 2,
+            out = 1 - in;
+        status |= clSetKernelArg(step_kernel, 4u, sizeof(cl_mem), bodies_mem + in);
+        status |= clSetKernelArg(step_kernel, 5u, sizeof(cl_mem), bodies_mem + out);
+
+        cl_uint wait_count = buffer_reads[out] ? 1u : 0u;
+        cl_int launched = clEnqueueNDRangeKernel(
+            commands, step_kernel, 1, NULL, global_work_size, local_work_size,
+            wait_count, wait_count ? buffer_reads + out : NULL, &kernel_done
+        );
+        status |= launched;
+        clFlush(commands);
+        if (buffer_reads[out]) {
+            clReleaseEvent(buffer_reads[out]);
+            buffer_reads[out] = NULL;
+        }
+        if (status != CL_SUCCESS) {
+            if (launched == CL_SUCCESS)
+                clReleaseEvent(kernel_done);
+            break;
+        }
+
+        if (writing && (step + 1) % snapshot_interval == 0) {
+            int slot = acquire_slot(&writer);
+            cl_event read;
+            status |= clEnqueueReadBuffer(
+                readback, bodies_mem[out], CL_FALSE, 0, bodies_size, writer.slots[slot],
+                1, &kernel_done, &read
+            );
+            if (status == CL_SUCCESS) {
+                clFlush(readback);
+                clRetainEvent(read);
+                buffer_reads[out] = read;
+                queue_snapshot(&writer, slot, step + 1, read);
+            }
+        }
+        clReleaseEvent(kernel_done);
+    }
+
+    if (writing) {
+        pthread_mutex_lock(&writer.lock);
+        writer.finished = 1;
+        pthread_cond_broadcast(&writer.changed);
+        pthread_mutex_unlock(&writer.lock);
+        pthread_join(writer_thread, NULL);
+    }
+    pthread_mutex_destroy(&writer.lock);
+    pthread_cond_destroy(&writer.changed);
+
+    if (status == CL_SUCCESS)
+        status |= clEnqueueReadBuffer(commands, bodies_mem[simulation_steps % 2], CL_TRUE, 0, bodies_size, bodies, 0, NULL, NULL);
+
+    for (int b = 0; b < 2; ++b) {
+        if (buffer_reads[b])
+            clReleaseEvent(buffer_reads[b]);
+        if (bodies_mem[b])
+            clReleaseMemObject(bodies_mem[b]);
+        free(host_buffers[b]);
+    }
+    for (int slot = 0; slot < SNAPSHOT_SLOTS; ++slot)
+        free(writer.slots[slot]);
+    if (step_kernel)
+        clReleaseKernel(step_kernel);
+    if (commands)
+        clReleaseCommandQueue(commands);
+    if (readback)
+        clReleaseCommandQueue(readback);
+
+    return status;
+}
+
 int main(int argc, char **argv)
 {
+    const char *device_choice = getenv("N_BODIES_DEVICE");
+    if (device_choice && strcmp(device_choice, "list") == 0)
+        return list_devices() == CL_SUCCESS ? 0 : 1;
+
     if (argc < 4) {
         return 1488;
     }
@@ -244,59 +863,91 @@ int main(int argc, char **argv)
         &bodies_count, &simulation_steps
     );
     
-    Body bodies[bodies_count];
+    // host copy of the bodies, the device buffers are created by run_pipelined
+    Arena arena;
+    arena_create(&arena, arena_aligned(bodies_count * sizeof(Body)), huge_pages_from_env());
+    Body *bodies = arena_alloc(&arena, bodies_count * sizeof(Body));
     for (int i = 0; i < bodies_count; ++i)
         bodies[i] = read_body(task_file);
             
     fclose(task_file);
+    report_arena(&arena, bodies, bodies + bodies_count - 1);
+
+    // snapshots of every k-th step, 0 reads the bodies back only at the end
+    int snapshot_interval = argc > 5 ? atoi(argv[4]) : 0;
+    FILE *snapshot_file = NULL;
+    if (snapshot_interval > 0) {
+        snapshot_file = fopen(argv[5], "w");
+        if (!snapshot_file) {
+            fprintf(stderr, "Error: Could not open %s\n", argv[5]);
+            return 1;
+        }
+    }
 
     cl_device_id device_id;
     cl_int status = get_device_id(&device_id);
+    if (status != CL_SUCCESS) {
+        fprintf(stderr, "Error: No OpenCL device found (N_BODIES_DEVICE=list shows them)\n");
+        return 1;
+    }
     cl_context context = clCreateContext(0, 1, &device_id, NULL, NULL, &status);
-    cl_command_queue commands = clCreateCommandQueueWithProperties(context, device_id, NULL, &status);
 
+    cl_mem g_mem = clCreateBuffer(context,  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,  sizeof(float), &g, &status),
+        body_radius_mem = clCreateBuffer(context,  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,  sizeof(float), &body_radius, &status),
+        bodies_count_mem = clCreateBuffer(context,  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,  sizeof(int), &bodies_count, &status),
+        model_dt_mem = clCreateBuffer(context,  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,  sizeof(float), &model_dt, &status);
+
+    // the step kernel is tuned once per device and range of bodies counts
+    Tuning tuning = { 64, 64, 1 };
+    char device_name[256];
+    get_device_name(device_id, device_name, sizeof(device_name));
+    if (!load_tuning(device_name, bodies_count, &tuning)) {
+        status = autotune(
+            argv[1], context, device_id,
+            g_mem, body_radius_mem, bodies_count_mem, model_dt_mem,
+            bodies_count, bodies, &tuning
+        );
+        if (status == CL_SUCCESS)
+            save_tuning(device_name, bodies_count, tuning);
+    }
+    fprintf(
+        stderr, "Device: %s, local size: %d, tile size: %d, unroll: %d\n",
+        device_name, tuning.local_size, tuning.tile_size, tuning.unroll
+    );
+
+    char options[64];
+    format_build_options(tuning, options);
     cl_program program;
-    status = build_from_source(argv[1], context, device_id, &program);
-    cl_kernel solve = clCreateKernel(program, "sol", &status);
+    status = build_from_source(argv[1], options, context, device_id, &program);
     if (status != CL_SUCCESS) {
         fprintf(stderr, "Boom! Status: %s\n", err_code(status));
         return 1488;
     }
 
-    cl_mem g_mem = clCreateBuffer(context,  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,  sizeof(float), &g, &status),
-        body_radius_mem = clCreateBuffer(context,  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,  sizeof(float), &body_radius, &status),
-        bodies_count_mem = clCreateBuffer(context,  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,  sizeof(int), &bodies_count, &status),
-        model_dt_mem = clCreateBuffer(context,  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,  sizeof(float), &model_dt, &status),
-        simulation_steps_mem = clCreateBuffer(context,  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,  sizeof(int), &simulation_steps, &status),
-        accelerations_mem = clCreateBuffer(context,  CL_MEM_READ_WRITE, bodies_count * bodies_count * sizeof(Vector3), NULL, &status),
-        bodies_mem = clCreateBuffer(context,  CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,  bodies_count * sizeof(Body), bodies, &status);
-    
-    status = clSetKernelArg(solve, 0u, sizeof(cl_mem), &g_mem);
-    status |= clSetKernelArg(solve, 1u, sizeof(cl_mem), &body_radius_mem);
-    status |= clSetKernelArg(solve, 2u, sizeof(cl_mem), &bodies_count_mem);
-    status |= clSetKernelArg(solve, 3u, sizeof(cl_mem), &model_dt_mem);
-    status |= clSetKernelArg(solve, 4u, sizeof(cl_mem), &simulation_steps_mem);
-    status |= clSetKernelArg(solve, 5u, sizeof(cl_mem), &accelerations_mem);
-    status |= clSetKernelArg(solve, 6u, sizeof(cl_mem), &bodies_mem);
-
     double begin = clock(),
         end;
 
-    size_t global_work_size[] = { bodies_count, bodies_count };
-    status = clEnqueueNDRangeKernel(commands, solve, 2, NULL, global_work_size, global_work_size, 0u, NULL, NULL);
-    status = clEnqueueReadBuffer(commands, bodies_mem, CL_TRUE, 0, bodies_count * sizeof(Body), bodies, 0, NULL, NULL);
+    status = run_pipelined(
+        context, device_id, program,
+        g_mem, body_radius_mem, bodies_count_mem, model_dt_mem,
+        bodies_count, simulation_steps, bodies,
+        tuning.local_size, snapshot_interval, snapshot_file
+    );
+    if (snapshot_file)
+        fclose(snapshot_file);
 
     end = clock();
+    if (status != CL_SUCCESS) {
+        fprintf(stderr, "Boom! Status: %s\n", err_code(status));
+        return 1488;
+    }
     printf("Time taken: %lf sec\n", ((double) (end - begin)) / CLOCKS_PER_SEC);
 
     clReleaseMemObject(g_mem);
     clReleaseMemObject(body_radius_mem);
     clReleaseMemObject(bodies_count_mem);
-    clReleaseMemObject(bodies_mem);
-    clReleaseMemObject(accelerations_mem);
+    clReleaseMemObject(model_dt_mem);
     clReleaseProgram(program);
-    clReleaseKernel(solve);
-    clReleaseCommandQueue(commands);
     clReleaseContext(context);
 
     FILE *solution_file = fopen(argv[3], "w");
@@ -305,6 +956,7 @@ int main(int argc, char **argv)
         fprintf(solution_file, "\n");
     }
     fclose(solution_file);
+    arena_destroy(&arena);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -61,69 +61,59 @@ Vector3 induced_acceleration(
     return multiply(body_2.mass, density);
 }
 
-__kernel void sol(
+#ifndef TILE_SIZE
+#define TILE_SIZE 64
+#endif
+
+#ifndef UNROLL
+#define UNROLL 1
+#endif
+
+/*
+ * One step for one body, bodies_in and bodies_out are never the same buffer.
+ * The work-group walks through the bodies in tiles of TILE_SIZE kept in local memory.
+ */
+__kernel void step(
     __constant float *g,
     __constant float *body_radius,
     __constant int *bodies_count_ptr,
     __constant float *model_dt,
-    __constant int *steps_count_ptr,
-    __global Vector3 *accelerations,
-    __global Body *bodies
+    __global const Body *bodies_in,
+    __global Body *bodies_out
 )
 {
+    __local Body tile[TILE_SIZE];
+
     int i = get_global_id(0),
-        j = get_global_id(1),
-        bodies_count = *bodies_count_ptr,
-        steps_count = *steps_count_ptr;
-    
-    for (int step = 0; step < steps_count; ++step) {
-        // calculate accelerations
-        if (i == j)
-            accelerations[i * bodies_count + j].x =
-                accelerations[i * bodies_count + j].y = 
-                accelerations[i * bodies_count + j].z = 0.0;
-        else
-            accelerations[i * bodies_count + j] = induced_acceleration(
-                *g, *body_radius, bodies[i], bodies[j]
-            );
-        
-        barrier(CLK_GLOBAL_MEM_FENCE);
+        local_id = get_local_id(0),
+        local_size = get_local_size(0),
+        bodies_count = *bodies_count_ptr;
 
-        // sum accelerations
-        int length = bodies_count;
-        while (length > 1) {
-            int length_is_odd = length % 2;
-            
-            if (j < length / 2)
-                accelerations[i * bodies_count + j] = plus(
-                    accelerations[i * bodies_count + 2 * j],
-                    accelerations[i * bodies_count + 2 * j + 1]
-                );
-            else if ((j == length / 2) && length_is_odd)
-                accelerations[i * bodies_count + j] =
-                    accelerations[i * bodies_count + length - 1];
-            
-            length /= 2;
-            if (length_is_odd)
-                length += 1;
-            
-            barrier(CLK_GLOBAL_MEM_FENCE);
-        }
+    Body body;
+    if (i < bodies_count)
+        body = bodies_in[i];
+    Vector3 acceleration = { 0.0f, 0.0f, 0.0f };
 
-        // accelerate
-        if (j == 0)
-            bodies[i].velocity = plus(
-                bodies[i].velocity,
-                accelerations[i * bodies_count]
-            );
-        barrier(CLK_GLOBAL_MEM_FENCE);
-        
-        // move
-        if (j == 0)
-            bodies[i].position = plus(
-                bodies[i].position,
-                multiply(*model_dt, bodies[i].velocity)
-            );
-        }
-        barrier(CLK_GLOBAL_MEM_FENCE);
-}
\ No newline at end of file
+    for (int tile_start = 0; tile_start < bodies_count; tile_start += TILE_SIZE) {
+        int tile_length = min(TILE_SIZE, bodies_count - tile_start);
+        for (int k = local_id; k < tile_length; k += local_size)
+            tile[k] = bodies_in[tile_start + k];
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        if (i < bodies_count)
+            for (int k = 0; k < tile_length; k += UNROLL)
+                for (int u = 0; u < UNROLL; ++u)
+                    if (k + u < tile_length && tile_start + k + u != i)
+                        acceleration = plus(
+                            acceleration,
+                            induced_acceleration(*g, *body_radius, body, tile[k + u])
+                        );
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (i < bodies_count) {
+        body.velocity = plus(body.velocity, acceleration);
+        body.position = plus(body.position, multiply(*model_dt, body.velocity));
+        bodies_out[i] = body;
+    }
+}
@@ -1,4 +1,9 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <math.h>
 #include <time.h>
 
@@ -96,21 +101,26 @@ Vector3 induced_acceleration(
     return multiply(body_2.mass, density);
 }
 
+#define TILE_SIZE 64 // bodies of a column tile stay in L1 while all rows are walked
+
 void calculate_accelerations(
     double gravitation_const, double body_radius,
     int bodies_count, Body *bodies, Vector3 *accelerations
 )
 {
-    for (int i = 0; i < bodies_count; ++i)
-        for (int j = 0; j < bodies_count; ++j)
-            if (i == j)
-                accelerations[i * bodies_count + j].x =
-                    accelerations[i * bodies_count + j].y = 
-                    accelerations[i * bodies_count + j].z = 0.0;
-            else
-                accelerations[i * bodies_count + j] = induced_acceleration(
-                    gravitation_const, body_radius, bodies[i], bodies[j]
-                );
+    for (int tile = 0; tile < bodies_count; tile += TILE_SIZE) {
+        int tile_end = tile + TILE_SIZE < bodies_count ? tile + TILE_SIZE : bodies_count;
+        for (int i = 0; i < bodies_count; ++i)
+            for (int j = tile; j < tile_end; ++j)
+                if (i == j)
+                    accelerations[i * bodies_count + j].x =
+                        accelerations[i * bodies_count + j].y = 
+                        accelerations[i * bodies_count + j].z = 0.0;
+                else
+                    accelerations[i * bodies_count + j] = induced_acceleration(
+                        gravitation_const, body_radius, bodies[i], bodies[j]
+                    );
+    }
 }
 
 void accelerate(
@@ -135,10 +145,247 @@ void move(
         );
 }
 
+#define ARENA_ALIGNMENT 64
+#define HUGE_PAGE_SIZE (2ul << 20)
+// flags of get_mempolicy, see numaif.h
+#define MPOL_F_NODE (1 << 0)
+#define MPOL_F_ADDR (1 << 1)
+
+typedef enum HugePages {
+    HUGE_PAGES_OFF,
+    HUGE_PAGES_TRANSPARENT,
+    HUGE_PAGES_EXPLICIT
+} HugePages;
+
+const char *huge_pages_name(HugePages huge_pages)
+{
+    switch (huge_pages) {
+        case HUGE_PAGES_TRANSPARENT:
+            return "transparent huge pages";
+        case HUGE_PAGES_EXPLICIT:
+            return "explicit huge pages";
+        default:
+            return "regular pages";
+    }
+}
+
+// N_BODIES_HUGE_PAGES=thp or N_BODIES_HUGE_PAGES=explicit
+HugePages huge_pages_from_env(void)
+{
+    char *value = getenv("N_BODIES_HUGE_PAGES");
+    if (value && strcmp(value, "thp") == 0)
+        return HUGE_PAGES_TRANSPARENT;
+    if (value && strcmp(value, "explicit") == 0)
+        return HUGE_PAGES_EXPLICIT;
+    return HUGE_PAGES_OFF;
+}
+
+// one anonymous mapping for all arrays of a simulation
+typedef struct Arena {
+    char *mapping;
+    size_t mapping_size;
+    char *memory;
+    size_t capacity;
+    size_t used;
+    size_t page_size;
+    HugePages huge_pages;
+} Arena;
+
+size_t arena_aligned(size_t size)
+{
+    return (size + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+}
+
+void arena_create(Arena *arena, size_t capacity, HugePages huge_pages)
+{
+    arena->page_size = sysconf(_SC_PAGESIZE);
+    arena->huge_pages = huge_pages;
+    arena->capacity = capacity;
+    arena->used = 0;
+    arena->mapping = MAP_FAILED;
+
+    if (huge_pages == HUGE_PAGES_EXPLICIT) {
+        arena->mapping_size = (capacity + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        arena->mapping = mmap(
+            NULL, arena->mapping_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0
+        );
+        if (arena->mapping != MAP_FAILED) {
+            arena->memory = arena->mapping;
+            arena->page_size = HUGE_PAGE_SIZE;
+        } else {
+            arena->huge_pages = HUGE_PAGES_TRANSPARENT; // no reserved huge pages
+        }
+    }
+
+    if (arena->mapping == MAP_FAILED) {
+        // one extra huge page to align the start for transparent huge pages
+        arena->mapping_size = capacity + HUGE_PAGE_SIZE;
+        arena->mapping = mmap(
+            NULL, arena->mapping_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+        );
+        if (arena->mapping == MAP_FAILED) {
+            fprintf(stderr, "Error: Could not map %zu bytes\n", arena->mapping_size);
+            exit(EXIT_FAILURE);
+        }
+        arena->memory = (char *) (((size_t) arena->mapping + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+
+        if (arena->huge_pages == HUGE_PAGES_TRANSPARENT) {
+            if (madvise(arena->memory, capacity, MADV_HUGEPAGE) == 0)
+                arena->page_size = HUGE_PAGE_SIZE;
+            else
+                arena->huge_pages = HUGE_PAGES_OFF;
+        }
+    }
+}
+
+void *arena_alloc(Arena *arena, size_t size)
+{
+    size = arena_aligned(size);
+    if (arena->used + size > arena->capacity) {
+        fprintf(stderr, "Error: Arena of %zu bytes is exhausted\n", arena->capacity);
+        exit(EXIT_FAILURE);
+    }
+    void *result = arena->memory + arena->used;
+    arena->used += size;
+    return result;
+}
+
+void arena_destroy(Arena *arena)
+{
+    munmap(arena->mapping, arena->mapping_size);
+}
+
+// -1 if the page is not mapped yet or the kernel has no NUMA support
+int numa_node_of(void *address)
+{
+    int node = -1;
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0ul, address, MPOL_F_NODE | MPOL_F_ADDR) != 0)
+        return -1;
+    return node;
+}
+
+void report_arena(Arena *arena, void *first, void *last)
+{
+    fprintf(
+        stderr, "Arena: %zu bytes, page size %zu (%s), NUMA nodes of the first and the last blocks: %d, %d\n",
+        arena->capacity, arena->page_size, huge_pages_name(arena->huge_pages),
+        numa_node_of(first), numa_node_of(last)
+    );
+}
+
+unsigned long long spread_bits(unsigned long long v)
+{
+    v &= 0x1fffffull;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+// interleaves 21 bits of every coordinate, normalized to the bounding box
+unsigned long long morton_key(Vector3 position, Vector3 lower, Vector3 upper)
+{
+    const double scale = (double) 0x1fffff;
+    double coords[] = { position.x, position.y, position.z },
+        lowers[] = { lower.x, lower.y, lower.z },
+        uppers[] = { upper.x, upper.y, upper.z };
+    unsigned long long key = 0ull;
+    for (int d = 0; d < 3; ++d) {
+        double extent = uppers[d] - lowers[d],
+            normalized = extent > 0.0 ? (coords[d] - lowers[d]) / extent : 0.0;
+        key |= spread_bits((unsigned long long) (normalized * scale)) << d;
+    }
+    return key;
+}
+
+// LSD radix sort by bytes, permutation is moved along with the keys
+void radix_sort(Arena *arena, int count, unsigned long long *keys, int *permutation)
+{
+    size_t mark = arena->used;
+    unsigned long long *key_buff = arena_alloc(arena, count * sizeof(unsigned long long));
+    int *permutation_buff = arena_alloc(arena, count * sizeof(int));
+    unsigned long long *src_keys = keys, *dst_keys = key_buff, *swap_keys;
+    int *src_permutation = permutation, *dst_permutation = permutation_buff, *swap_permutation;
+
+    for (int shift = 0; shift < 64; shift += 8) {
+        int histogram[256] = { 0 };
+        for (int i = 0; i < count; ++i)
+            ++histogram[(src_keys[i] >> shift) & 0xff];
+
+        int sum = 0;
+        for (int d = 0; d < 256; ++d) {
+            int digit_count = histogram[d];
+            histogram[d] = sum;
+            sum += digit_count;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            int position = histogram[(src_keys[i] >> shift) & 0xff]++;
+            dst_keys[position] = src_keys[i];
+            dst_permutation[position] = src_permutation[i];
+        }
+
+        swap_keys = src_keys; src_keys = dst_keys; dst_keys = swap_keys;
+        swap_permutation = src_permutation; src_permutation = dst_permutation; dst_permutation = swap_permutation;
+    }
+    // even number of passes, so the result is back in keys and permutation
+    arena->used = mark;
+}
+
+// arena space taken by reorder_bodies for the time of the call
+size_t reorder_scratch_size(int bodies_count)
+{
+    return 2 * arena_aligned(bodies_count * sizeof(unsigned long long))
+        + 3 * arena_aligned(bodies_count * sizeof(int))
+        + arena_aligned(bodies_count * sizeof(Body));
+}
+
+// sorts bodies along the Morton curve, order[k] keeps the input position of bodies[k]
+void reorder_bodies(Arena *arena, int bodies_count, Body *bodies, int *order)
+{
+    size_t mark = arena->used;
+
+    Vector3 lower = bodies[0].position,
+        upper = bodies[0].position;
+    for (int i = 1; i < bodies_count; ++i) {
+        Vector3 p = bodies[i].position;
+        lower.x = fmin(lower.x, p.x); upper.x = fmax(upper.x, p.x);
+        lower.y = fmin(lower.y, p.y); upper.y = fmax(upper.y, p.y);
+        lower.z = fmin(lower.z, p.z); upper.z = fmax(upper.z, p.z);
+    }
+
+    unsigned long long *keys = arena_alloc(arena, bodies_count * sizeof(unsigned long long));
+    int *permutation = arena_alloc(arena, bodies_count * sizeof(int));
+    for (int i = 0; i < bodies_count; ++i) {
+        keys[i] = morton_key(bodies[i].position, lower, upper);
+        permutation[i] = i;
+    }
+    radix_sort(arena, bodies_count, keys, permutation);
+
+    Body *body_buff = arena_alloc(arena, bodies_count * sizeof(Body));
+    int *order_buff = arena_alloc(arena, bodies_count * sizeof(int));
+    for (int i = 0; i < bodies_count; ++i) {
+        body_buff[i] = bodies[permutation[i]];
+        order_buff[i] = order[permutation[i]];
+    }
+    for (int i = 0; i < bodies_count; ++i) {
+        bodies[i] = body_buff[i];
+        order[i] = order_buff[i];
+    }
+
+    arena->used = mark;
+}
+
 int main(int argc, char **argv)
 {
     double gravitation_const, body_radius, model_delta_t;
     int bodies_count, simulation_steps;
+    // bodies are sorted along the Morton curve every reorder_interval steps, 0 disables it
+    int reorder_interval = argc > 3 ? atoi(argv[3]) : 0;
     
     FILE *task_file = fopen(argv[1], "r");
     fscanf(
@@ -147,17 +394,34 @@ int main(int argc, char **argv)
         &bodies_count, &simulation_steps
     );
     
-    Body bodies[bodies_count];
-    for (int i = 0; i < bodies_count; ++i)
+    Arena arena;
+    arena_create(
+        &arena,
+        2 * arena_aligned(bodies_count * sizeof(Body))
+            + arena_aligned(bodies_count * sizeof(int))
+            + arena_aligned((size_t) bodies_count * bodies_count * sizeof(Vector3))
+            + reorder_scratch_size(bodies_count),
+        huge_pages_from_env()
+    );
+    Body *bodies = arena_alloc(&arena, bodies_count * sizeof(Body)),
+        *ordered_bodies = arena_alloc(&arena, bodies_count * sizeof(Body));
+    int *order = arena_alloc(&arena, bodies_count * sizeof(int));
+    Vector3 *accelerations = arena_alloc(&arena, (size_t) bodies_count * bodies_count * sizeof(Vector3));
+
+    for (int i = 0; i < bodies_count; ++i) {
         bodies[i] = read_body(task_file);
+        order[i] = i;
+    }
             
     fclose(task_file);
+    report_arena(&arena, bodies, accelerations + (size_t) bodies_count * bodies_count - 1);
 
     clock_t begin, end;
     begin = clock();
     
-    Vector3 accelerations[bodies_count * bodies_count];
     for (int i = 0; i < simulation_steps; ++i) {
+        if (reorder_interval > 0 && i % reorder_interval == 0)
+            reorder_bodies(&arena, bodies_count, bodies, order);
         calculate_accelerations(gravitation_const, body_radius, bodies_count, bodies, accelerations);
         accelerate(bodies_count, bodies, accelerations);
         move(model_delta_t, bodies_count, bodies);
@@ -166,12 +430,17 @@ int main(int argc, char **argv)
     end = clock();
     printf("Time taken: %lf sec\n", ((double) (end - begin)) / CLOCKS_PER_SEC);
 
+    // restore the input order
+    for (int i = 0; i < bodies_count; ++i)
+        ordered_bodies[order[i]] = bodies[i];
+
     FILE *solution_file = fopen(argv[2], "w");
     for (int i = 0; i < bodies_count; ++i) {
-        write_body(solution_file, bodies[i]);
+        write_body(solution_file, ordered_bodies[i]);
         fprintf(solution_file, "\n");
     }
     fclose(solution_file);
+    arena_destroy(&arena);
     
     return 0;
 }